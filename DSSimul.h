@@ -2,6 +2,7 @@
 #define _CRT_SECURE_NO_WARNINGS 1
 #include <queue>
 #include <map>
+#include <unordered_map>
 #include <string>
 #include <fstream>
 #include <set>
@@ -10,12 +11,37 @@
 #include <thread>
 #include <chrono>
 #include <exception>
-#include <random>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <new>
+#include <typeinfo>
+#include <type_traits>
+#include <tuple>
+#include <initializer_list>
+#include <algorithm>
+#include <limits>
+#include <cmath>
 #include <string.h>
+#include <stdarg.h>
+#include <stdio.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 using namespace std;
 
 using int32 = int;
 using uint32 =  unsigned;
+using uint16 = unsigned short;
 using byte = unsigned char;
 using int64 = long long;
 using uint64 = unsigned long long;
@@ -31,232 +57,2501 @@ struct ErrorCode {
     };
 };
 
+// Счётчики и гистограммы модели (см. World::stats()). Сборка с -DDSSIMUL_STATS=0 убирает их полностью:
+// из процессов и связей исчезают поля статистики, а из горячего пути - все обращения к ним.
+#ifndef DSSIMUL_STATS
+#define DSSIMUL_STATS 1
+#endif
+#if DSSIMUL_STATS
+#define DSS_STAT(x) x
+#else
+#define DSS_STAT(x)
+#endif
+
+// Счётчик с одним писателем: увеличивается без блокировок и без атомарного сложения (только запись),
+// а читать его можно из любого потока в любой момент.
+template<class T> class StatCounter {
+public:
+    StatCounter(T v = 0) : value(v) {}
+    StatCounter(StatCounter const &o) : value(o.get()) {}
+    StatCounter &operator=(StatCounter const &o) { value.store(o.get(), memory_order_relaxed); return *this; }
+    void add(T d) { value.store(value.load(memory_order_relaxed) + d, memory_order_relaxed); }
+    void operator++(int) { add(1); }
+    void raise(T v) { if (v > get()) value.store(v, memory_order_relaxed); }
+    T get() const { return value.load(memory_order_relaxed); }
+    operator T() const { return get(); }
+private:
+    atomic<T> value;
+};
+
+// Гистограмма по степеням двойки: отрезок 0 - значения <= 0, отрезок i - значения [2^(i-1), 2^i)
+struct Histogram {
+    enum { Buckets = 32 };
+    StatCounter<uint32> counts[Buckets];
+    static int bucket(int64 v) {
+        if (v <= 0) return 0;
+#if defined(__GNUC__)
+        int b = 64 - __builtin_clzll((uint64)v);
+#else
+        int b = 0;
+        for (uint64 x = (uint64)v; x != 0; x >>= 1) b++;
+#endif
+        return b < Buckets ? b : Buckets - 1;
+    }
+    void add(int64 v) { counts[bucket(v)]++; }
+    uint64 total() const {
+        uint64 n = 0;
+        for (auto const &c: counts) n += c.get();
+        return n;
+    }
+    // Верхняя граница отрезка, в который попадает доля q значений
+    int64 percentile(double q) const {
+        uint64 n = total(), seen = 0;
+        if (n == 0) return 0;
+        uint64 rank = (uint64)(q * (double)(n - 1));
+        for (int i = 0; i < Buckets; i++) {
+            seen += counts[i].get();
+            if (seen > rank) return i == 0 ? 0 : (int64)((1ULL << i) - 1);
+        }
+        return (int64)((1ULL << (Buckets - 1)) - 1);
+    }
+};
+
+// Причины отброшенных при отправке сообщений: получатель вне сети (SizeTooBig), нет процесса 
+// или связи (ItemNotFound), потеря по errorRate, потеря на связи (loss, burst)
+enum DropReason { DropSizeTooBig, DropNoRoute, DropLoss, DropLinkLoss, DropReasons };
+
+// Статистика процесса. Поля, кроме enqueued, меняет только поток, исполняющий обработчик процесса 
+// (при отправке - поток отправителя), поэтому на горячем пути нет ни блокировок, ни общих счётчиков.
+struct ProcessStats {
+    atomic<int64> enqueued{0};              // поставлено в очередь процессу (сообщения, таймеры, *TIME)
+    StatCounter<int64> delivered, unhandled;
+    StatCounter<int64> maxDepth;            // наибольшее число событий, ждущих доставки (enqueued - delivered)
+    StatCounter<int64> drops[DropReasons];  // отброшено при отправке этим процессом
+    enum { HandlerSample = 16 };
+    Histogram handlerNs;                    // время работы обработчика, нс (первое событие процесса и 
+                                            // каждое HandlerSample-е событие потока)
+    Histogram lateness;                     // опоздание доставки: now() - deliveryTime, такты
+};
+
+// Статистика связи; меняет только поток отправителя
+struct LinkStats {
+    StatCounter<int64> sent, dropped, duplicated;
+};
+
+// Снимок статистики модели: World::stats(), директива "dump stats файл"
+struct StatsSnapshot {
+    struct ProcessRow {
+        int node = 0;
+        int64 enqueued = 0, delivered = 0, unhandled = 0, pending = 0, maxDepth = 0, sent = 0, lost = 0;
+        int64 drops[DropReasons] = {};
+        int64 handlerNs[Histogram::Buckets] = {}, lateness[Histogram::Buckets] = {};
+    };
+    struct LinkRow {
+        int from = 0, to = 0;
+        int64 sent = 0, dropped = 0, duplicated = 0;
+    };
+    bool enabled = DSSIMUL_STATS != 0;
+    int64 tick = 0;
+    int64 externalSent = 0, externalDrops[DropReasons] = {};
+    vector<ProcessRow> processes;
+    vector<LinkRow> links;
+    static int64 percentile(int64 const *counts, double q) {
+        Histogram h;
+        for (int i = 0; i < Histogram::Buckets; i++) h.counts[i] = StatCounter<uint32>((uint32)counts[i]);
+        return h.percentile(q);
+    }
+    bool writeCsv(FILE *f) const {
+        fprintf(f, "# tick %lld, external sent %lld\n", tick, externalSent);
+        fprintf(f, "node,enqueued,delivered,unhandled,pending,max_depth,sent,lost,drop_size,drop_noroute,drop_loss,"
+            "drop_linkloss,handler_p50_ns,handler_p99_ns,handler_max_ns,late_p50,late_p99,late_max\n");
+        for (auto const &r: processes) {
+            fprintf(f, "%d,%lld,%lld,%lld,%lld,%lld,%lld,%lld", r.node, r.enqueued, r.delivered, r.unhandled, 
+                r.pending, r.maxDepth, r.sent, r.lost);
+            for (auto d: r.drops) fprintf(f, ",%lld", d);
+            fprintf(f, ",%lld,%lld,%lld,%lld,%lld,%lld\n", percentile(r.handlerNs, 0.5), percentile(r.handlerNs, 0.99),
+                percentile(r.handlerNs, 1), percentile(r.lateness, 0.5), percentile(r.lateness, 0.99), percentile(r.lateness, 1));
+        }
+        fprintf(f, "\nfrom,to,sent,dropped,duplicated\n");
+        for (auto const &l: links) fprintf(f, "%d,%d,%lld,%lld,%lld\n", l.from, l.to, l.sent, l.dropped, l.duplicated);
+        return !ferror(f);
+    }
+    bool writeJson(FILE *f) const {
+        static const char *dropNames[DropReasons] = { "size", "noroute", "loss", "linkloss" };
+        auto array = [f](int64 const *v, int n) {
+            fprintf(f, "[");
+            for (int i = 0; i < n; i++) fprintf(f, i ? ",%lld" : "%lld", v[i]);
+            fprintf(f, "]");
+        };
+        fprintf(f, "{\"enabled\":%s,\"tick\":%lld,\"external_sent\":%lld,\"external_drops\":", 
+            enabled ? "true" : "false", tick, externalSent);
+        array(externalDrops, DropReasons);
+        fprintf(f, ",\"processes\":[");
+        for (size_t i = 0; i < processes.size(); i++) {
+            auto const &r = processes[i];
+            fprintf(f, "%s\n{\"node\":%d,\"enqueued\":%lld,\"delivered\":%lld,\"unhandled\":%lld,\"pending\":%lld,"
+                "\"max_depth\":%lld,\"sent\":%lld,\"lost\":%lld,\"drops\":{", i ? "," : "", r.node, r.enqueued, 
+                r.delivered, r.unhandled, r.pending, r.maxDepth, r.sent, r.lost);
+            for (int d = 0; d < DropReasons; d++) fprintf(f, "%s\"%s\":%lld", d ? "," : "", dropNames[d], r.drops[d]);
+            fprintf(f, "},\"handler_ns_log2\":");
+            array(r.handlerNs, Histogram::Buckets);
+            fprintf(f, ",\"lateness_log2\":");
+            array(r.lateness, Histogram::Buckets);
+            fprintf(f, "}");
+        }
+        fprintf(f, "],\n\"links\":[");
+        for (size_t i = 0; i < links.size(); i++) {
+            auto const &l = links[i];
+            fprintf(f, "%s\n{\"from\":%d,\"to\":%d,\"sent\":%lld,\"dropped\":%lld,\"duplicated\":%lld}", 
+                i ? "," : "", l.from, l.to, l.sent, l.dropped, l.duplicated);
+        }
+        fprintf(f, "]}\n");
+        return !ferror(f);
+    }
+};
+
+// Строка внутри тела сообщения без копирования (аналог string_view). Действительна, пока живо сообщение.
+class StringRef {
+public:
+    StringRef() {}
+    StringRef(const char *s, size_t n) : s(s), n(n) {}
+    StringRef(const char *s) : s(s), n(strlen(s)) {}
+    StringRef(string const &s) : s(s.data()), n(s.size()) {}
+    const char *data() const { return s; }
+    size_t size() const { return n; }
+    bool empty() const { return n == 0; }
+    char operator[](size_t i) const { return s[i]; }
+    string str() const { return string(s, n); }
+    operator string() const { return str(); }
+    bool operator==(StringRef const &o) const { return n == o.n && memcmp(s, o.s, n) == 0; }
+    bool operator!=(StringRef const &o) const { return !(*this == o); }
+    bool operator==(const char *o) const { return *this == StringRef(o); }
+    bool operator!=(const char *o) const { return !(*this == StringRef(o)); }
+private:
+    const char *s = "";
+    size_t n = 0;
+};
+
+// Аргумент сообщения. Сам ничего не кодирует и не выделяет память: Message сначала суммирует 
+// размеры всех аргументов, а потом записывает их один раз в тело нужной длины.
+// Формат: байт типа, затем значение (int - 4 байта, int64 - 8 байт, младшие первыми; строка - байты и 0).
 class MessageArg {
 public:
     enum {
         IntType='A', Int64Type, StringType, VectorIntType, EOFType
     };
-    MessageArg(int64 q) {
-        uint64 pq = (uint64)q;
-        body.push_back((byte)Int64Type);
-        for (int i = 0; i < 8; i++) {
-            body.push_back((byte)(pq & 0xFF));
-            pq >>= 8;
+    MessageArg(int64 q) : kind(Int64Type), value(q) {}
+    MessageArg(int q) : kind(IntType), value(q) {}
+    MessageArg(string const &s) : kind(StringType), str(s.c_str()), len(strlen(s.c_str())) {}
+    MessageArg(const char *s) : kind(StringType), str(s), len(strlen(s)) {}
+    MessageArg(StringRef s) : kind(StringType), str(s.data()), len(s.size()) {}
+    size_t size() const { return kind == IntType ? 5 : kind == Int64Type ? 9 : len + 2; }
+    byte *write(byte *p) const {
+        *p++ = (byte)kind;
+        if (kind == StringType) {
+            memcpy(p, str, len);
+            p[len] = 0;
+            return p + len + 1;
         }
+        uint64 v = (uint64)value;
+        for (int i = 0, n = kind == IntType ? 4 : 8; i < n; i++, v >>= 8) *p++ = (byte)(v & 0xFF);
+        return p;
     }
-    MessageArg(int q) {
-        body.push_back((byte)IntType);
-        for (int i = 0; i <= 24; i+=8) {
-            body.push_back((byte)((q >> i) & 0xFF));
+private:
+    int kind;
+    int64 value = 0;
+    const char *str = nullptr;
+    size_t len = 0;
+};
+
+// Типы сообщений. Имя типа (первый строковый аргумент сообщения, например "BULLY_ELECTION") 
+// один раз превращается в целый номер, и доставка идёт по номеру без разбора строк.
+// Семейство типа - номер префикса, по нему сообщение находит свою рабочую функцию: самый длинный 
+// зарегистрированный префикс (registerFamily, "MY_ALGO" для "MY_ALGO_PING"), иначе - префикс до первого '_' ("BULLY").
+// Таблица только дополняется: читатели обходятся без блокировок, новое имя добавляется под мьютексом. 
+// Место в таблице выделяется с запасом, и копия делается только при удвоении ёмкости, поэтому прежние 
+// копии (их ещё могут читать другие потоки) вместе занимают не больше текущей.
+class MessageTypes {
+public:
+    enum { NoType = -1, AllHandlers = -2 };
+    static int id(const char *name, size_t len) {
+        Table const *t = instance().current.load(memory_order_acquire);
+        int ret = t->find(name, len);
+        return ret >= 0 ? ret : instance().insert(name, len, false);
+    }
+    static int id(const char *name) { return id(name, strlen(name)); }
+    static int id(string const &name) { return id(name.data(), name.size()); }
+    // Зарегистрировать префикс рабочей функции как семейство: типы "prefix_..." (и уже известные) 
+    // получают его номер, если нет более длинного зарегистрированного префикса. Возвращает номер семейства.
+    static int registerFamily(string const &prefix) {
+        return instance().insert(prefix.data(), prefix.size(), true);
+    }
+    // Тип сообщения по его телу или NoType, если тело не начинается со строки
+    static int of(const byte *body, size_t size) {
+        if (size == 0 || body[0] != (byte)MessageArg::StringType) return NoType;
+        const char *name = (const char *)body + 1;
+        const char *end = (const char *)memchr(name, 0, size - 1);
+        return id(name, end != nullptr ? (size_t)(end - name) : size - 1);
+    }
+    static int of(bytevector const &body) { return of(body.data(), body.size()); }
+    // Семейство типа: номер префикса, AllHandlers для служебных сообщений ('*') или NoType
+    static int family(int type) {
+        Table const *t = instance().current.load(memory_order_acquire);
+        return type >= 0 && type < t->count.load(memory_order_acquire) ? t->families[type].load(memory_order_relaxed) : NoType;
+    }
+    static string name(int type) {
+        Table const *t = instance().current.load(memory_order_acquire);
+        return type >= 0 && type < t->count.load(memory_order_acquire) ? t->names[type] : string();
+    }
+    // Число известных типов; их номера - 0..count()-1
+    static int count() {
+        return instance().current.load(memory_order_acquire)->count.load(memory_order_acquire);
+    }
+private:
+    // Имена и семейства занимают места 0..count-1 из capacity; ячейка slots публикует номер 
+    // уже записанного имени, поэтому поиск по таблице идёт одновременно с добавлением
+    struct Table {
+        explicit Table(int cap) : capacity(cap), names(cap), families(new atomic<int>[cap]), 
+                registered(cap, 0), slots(new atomic<int>[cap * 2]) {
+            for (int i = 0; i < cap * 2; i++) slots[i].store(-1, memory_order_relaxed);
+        }
+        const int capacity;
+        atomic<int> count{0};
+        vector<string> names;
+        unique_ptr<atomic<int>[]> families;
+        vector<byte> registered;        // префикс зарегистрирован как семейство (только под мьютексом)
+        unique_ptr<atomic<int>[]> slots; // открытая адресация: номер типа или -1
+        static uint64 hash(const char *s, size_t len) {
+            uint64 h = 1469598103934665603ULL;
+            for (size_t i = 0; i < len; i++) h = (h ^ (byte)s[i]) * 1099511628211ULL;
+            return h;
         }
+        int find(const char *s, size_t len) const {
+            size_t mask = (size_t)capacity * 2 - 1;
+            for (size_t i = (size_t)hash(s, len) & mask; ; i = (i + 1) & mask) {
+                int type = slots[i].load(memory_order_acquire);
+                if (type < 0) return -1;
+                string const &n = names[type];
+                if (n.size() == len && memcmp(n.data(), s, len) == 0) return type;
+            }
+        }
+        void place(int type) {
+            size_t mask = (size_t)capacity * 2 - 1;
+            size_t i = (size_t)hash(names[type].data(), names[type].size()) & mask;
+            while (slots[i].load(memory_order_relaxed) >= 0) i = (i + 1) & mask;
+            slots[i].store(type, memory_order_release);
+        }
+    };
+    static MessageTypes &instance() {
+        static MessageTypes types;
+        return types;
     }
-    MessageArg(string const &s) {
-        MessageArg(s.c_str());
+    MessageTypes() {
+        tables.emplace_back(new Table(64));
+        current = tables.back().get();
     }
-    MessageArg(const char *s) {
-        body.push_back((byte)StringType);
-        for (size_t i = 0; s[i] != 0; i++) {
-            body.push_back((unsigned char)s[i]);
+    int insert(const char *name, size_t len, bool family) {
+        lock_guard<mutex> ar(insertMutex);
+        int ret = insertLocked(name, len);
+        Table *t = current.load(memory_order_relaxed);
+        if (!family || t->registered[ret]) return ret;
+        t->registered[ret] = 1;
+        t->families[ret].store(ret, memory_order_relaxed);
+        // Уже известные типы "name_..." переходят в новое семейство, если оно длиннее прежнего
+        for (int i = 0; i < t->count.load(memory_order_relaxed); i++) {
+            string const &n = t->names[i];
+            int fam = t->families[i].load(memory_order_relaxed);
+            if (n.size() > len && n[len] == '_' && n.compare(0, len, name, len) == 0 && 
+                (fam == NoType || (fam >= 0 && t->names[fam].size() < len))) t->families[i].store(ret, memory_order_relaxed);
         }
-        body.push_back((byte)0);
+        return ret;
+    }
+    enum { Self = -3 };
+    int insertLocked(const char *name, size_t len) {
+        Table *t = current.load(memory_order_relaxed);
+        int ret = t->find(name, len);
+        if (ret >= 0) return ret;
+        // Семейство: '*' - все рабочие функции; самый длинный зарегистрированный префикс до '_';
+        // иначе префикс до первого '_', он добавляется в таблицу первым; имя без '_' - само себе семейство
+        int fam = Self;
+        const char *us = (const char *)memchr(name, '_', len);
+        if (len > 0 && name[0] == '*') fam = AllHandlers;
+        for (size_t i = len; fam == Self && i > 1; i--) {
+            if (name[i - 1] != '_') continue;
+            int prefix = t->find(name, i - 1);
+            if (prefix >= 0 && t->registered[prefix]) fam = prefix;
+        }
+        if (fam == Self && us == name) fam = NoType;
+        else if (fam == Self && us != nullptr) {
+            fam = insertLocked(name, us - name);
+            t = current.load(memory_order_relaxed);
+        }
+        if (t->count.load(memory_order_relaxed) == t->capacity) {
+            Table *bigger = new Table(t->capacity * 2);
+            int n = t->count.load(memory_order_relaxed);
+            for (int i = 0; i < n; i++) {
+                bigger->names[i] = t->names[i];
+                bigger->families[i].store(t->families[i].load(memory_order_relaxed), memory_order_relaxed);
+                bigger->registered[i] = t->registered[i];
+                bigger->place(i);
+            }
+            bigger->count.store(n, memory_order_relaxed);
+            tables.emplace_back(bigger);
+            current.store(bigger, memory_order_release);
+            t = bigger;
+        }
+        ret = t->count.load(memory_order_relaxed);
+        t->names[ret].assign(name, len);
+        t->families[ret].store(fam == Self ? ret : fam, memory_order_relaxed);
+        t->place(ret);
+        t->count.store(ret + 1, memory_order_release);
+        return ret;
     }
-    bytevector body;
+    mutex insertMutex;
+    atomic<Table *> current{nullptr};
+    vector<unique_ptr<Table> > tables;
+};
+
+// Тело сообщения неизменяемо. Короткое тело (до InlineSize байт - типичные служебные сообщения протоколов) 
+// хранится прямо в сообщении, не требует выделения памяти и копируется вместе с ним. Длинное тело лежит 
+// в общем буфере, который разделяют все копии сообщения: рассылка соседям увеличивает только счётчик ссылок.
+class Payload {
+public:
+    enum { InlineSize = 40 };
+    Payload() : local() {}
+    Payload(const byte *data, size_t n) {
+        byte *p = allocate(n);
+        if (n > 0) memcpy(p, data, n);
+    }
+    Payload(bytevector const &b) : Payload(b.data(), b.size()) {}
+    Payload(Payload const &o) { copyFrom(o); }
+    Payload(Payload &&o) { moveFrom(o); }
+    ~Payload() { release(); }
+    Payload &operator=(Payload const &o) {
+        if (this != &o) { release(); copyFrom(o); }
+        return *this;
+    }
+    Payload &operator=(Payload &&o) {
+        if (this != &o) { release(); moveFrom(o); }
+        return *this;
+    }
+    const byte *data() const { return onHeap() ? shared->data() : local; }
+    size_t size() const { return len; }
+    bool empty() const { return len == 0; }
+    byte operator[](size_t i) const { return data()[i]; }
+    // Место для записи нового тела из n байт
+    byte *allocate(size_t n) {
+        release();
+        len = (uint32)n;
+        if (!onHeap()) return local;
+        auto b = make_shared<bytevector>(n);
+        new (&shared) Shared(b);
+        return b->data();
+    }
+private:
+    using Shared = shared_ptr<const bytevector>;
+    bool onHeap() const { return len > InlineSize; }
+    void release() {
+        if (onHeap()) shared.~Shared();
+        len = 0;
+    }
+    // Копируются только len байт короткого тела: остаток local не инициализирован
+    void copyFrom(Payload const &o) {
+        len = o.len;
+        if (onHeap()) new (&shared) Shared(o.shared);
+        else if (len > 0) memcpy(local, o.local, len);
+    }
+    void moveFrom(Payload &o) {
+        len = o.len;
+        if (onHeap()) new (&shared) Shared(move(o.shared));
+        else if (len > 0) memcpy(local, o.local, len);
+        o.release();
+    }
+    // Короткое тело занимает место указателя на общий буфер: Payload - 48 байт
+    union {
+        byte local[InlineSize];
+        Shared shared;
+    };
+    uint32 len = 0;
 };
 
 class Message {
 public:
-    Message(int from, int to, bytevector const &body) {
-        this->from = from; this->to = to; this->body = body; 
+    Message(int from, int to, Payload const &body, int type) {
+        this->from = from; this->to = to; this->body = body; this->type = type;
     }
-    Message(MessageArg const &a1) {
-        append(a1);
+    Message(int from, int to, Payload const &body) {
+        this->from = from; this->to = to; this->body = body; 
+        type = MessageTypes::of(body.data(), body.size());
     }
-    Message(MessageArg const &a1, MessageArg const &a2) {
-        append(a1); append(a2);
+    Message(int from, int to, bytevector const &body) : Message(from, to, Payload(body)) {}
+    Message(MessageArg const &a1) { setBody(encode({a1})); }
+    Message(MessageArg const &a1, MessageArg const &a2) { setBody(encode({a1, a2})); }
+    Message(MessageArg const &a1, MessageArg const &a2, MessageArg const &a3) { setBody(encode({a1, a2, a3})); }
+    Message(MessageArg const &a1, MessageArg const &a2, MessageArg const &a3, MessageArg const &a4) { 
+        setBody(encode({a1, a2, a3, a4})); 
     }
-    Message(MessageArg const &a1, MessageArg const &a2, MessageArg const &a3) {
-        append(a1); append(a2); append(a3);
+    // Сообщение с любым числом аргументов (int, int64, строки): Message::make("PAXOS_ACCEPT", round, value)
+    template<class... Args> static Message make(Args const &... args) {
+        return Message(-1, -1, encode({MessageArg(args)...}));
     }
-    Message(MessageArg const &a1, MessageArg const &a2, MessageArg const &a3, MessageArg const &a4) {
-        append(a1); append(a2); append(a3); append(a4);
+    // Тело из аргументов: размер считается заранее, байты записываются один раз
+    static Payload encode(initializer_list<MessageArg> args) {
+        size_t n = 0;
+        for (auto const &a: args) n += a.size();
+        Payload body;
+        byte *p = body.allocate(n);
+        for (auto const &a: args) p = a.write(p);
+        return body;
     }
+    // Номер типа сообщения (см. MessageTypes) или MessageTypes::NoType
+    int type = MessageTypes::NoType;
     int64 sendTime = 0, deliveryTime = 0;
-    int from = -1, to = -1, ptr = 0;
-    bytevector body;
-    string getString() {
-        if (ptr < (int)body.size() && body[ptr] == (byte)MessageArg::StringType) {
-            string ret; ptr++;
-            while (ptr < (int)body.size() && body[ptr] != 0) {
-                ret.push_back((char)body[ptr++]);
+    // Порядковый номер сообщения у отправителя (origin). Пара (origin, seq) однозначно
+    // определяет сообщение и задаёт детерминированный порядок доставки при равном deliveryTime
+    int64 seq = 0;
+    int from = -1, to = -1, ptr = 0, origin = -1;
+    Payload body;
+    // Чтение аргументов по порядку: int a = m.read<int>(); 
+    // несколько сразу - в кортеж: tie(name, round, value) = m.read<StringRef, int, int64>();
+    // StringRef указывает внутрь тела сообщения и не копирует строку.
+    template<class T> T read() {
+        T v;
+        get(v);
+        return v;
+    }
+    template<class T1, class T2, class... Ts> tuple<T1, T2, Ts...> read() {
+        // Элементы списка в фигурных скобках вычисляются строго слева направо
+        return tuple<T1, T2, Ts...>{read<T1>(), read<T2>(), read<Ts>()...};
+    }
+    string getString() { return read<string>(); }
+    int getInt() { return read<int>(); }
+    int64 getInt64() { return read<int64>(); }
+    void get(int &v) {
+        const byte *p = take(MessageArg::IntType, 4, "Expected int");
+        v = (int)((uint32)p[0] | (uint32)p[1] << 8 | (uint32)p[2] << 16 | (uint32)p[3] << 24);
+    }
+    void get(int64 &v) {
+        const byte *p = take(MessageArg::Int64Type, 8, "Expected int64");
+        uint64 r = 0;
+        for (int i = 7; i >= 0; i--) r = (r << 8) | p[i];
+        v = (int64)r;
+    }
+    void get(StringRef &v) {
+        size_t size = body.size();
+        if (ptr < 0 || (size_t)ptr >= size || body[ptr] != (byte)MessageArg::StringType) 
+            throw std::logic_error("Expected string");
+        const char *s = (const char *)body.data() + ptr + 1;
+        const char *end = (const char *)memchr(s, 0, size - ptr - 1);
+        if (end == nullptr) throw std::logic_error("Expected string");
+        v = StringRef(s, end - s);
+        ptr += (int)(end - s) + 2;
+    }
+    void get(string &v) {
+        StringRef r;
+        get(r);
+        v.assign(r.data(), r.size());
+    }
+    bool operator>(Message const &oth) const {
+        if (deliveryTime != oth.deliveryTime) return deliveryTime > oth.deliveryTime;
+        if (origin != oth.origin) return origin > oth.origin;
+        if (seq != oth.seq) return seq > oth.seq;
+        return to > oth.to;
+    }
+    // Пропустить очередной аргумент, не разбирая его (например, имя типа, если тип уже известен по type)
+    void skip() {
+        if (ptr < 0 || ptr >= (int)body.size()) throw std::logic_error("Read out of bounds");
+        switch (body[ptr]) {
+        case MessageArg::IntType: take(MessageArg::IntType, 4, "Read out of bounds"); break;
+        case MessageArg::Int64Type: take(MessageArg::Int64Type, 8, "Read out of bounds"); break;
+        case MessageArg::StringType: { StringRef s; get(s); break; }
+        default: throw std::logic_error("Unknown argument type");
+        }
+    }
+private:
+    void setBody(Payload &&b) {
+        type = MessageTypes::of(b.data(), b.size());
+        body = move(b);
+    }
+    // Одна проверка границ на аргумент: тип kind и n байт значения; возвращает начало значения
+    const byte *take(int kind, size_t n, const char *error) {
+        if (ptr < 0 || (size_t)ptr + 1 + n > body.size() || body[ptr] != (byte)kind) throw std::logic_error(error);
+        const byte *p = body.data() + ptr + 1;
+        ptr += (int)n + 1;
+        return p;
+    }
+};
+
+// Почтовый ящик процесса: много отправителей, один получатель.
+// Отправители добавляют сообщения без блокировок (в стек входящих, атомарная операция CAS),
+// получатель забирает весь стек одной операцией и переносит его в свою кучу, упорядоченную по времени доставки.
+// Все методы, кроме enqueue(), вызываются только получателем (потоком, исполняющим процесс).
+class MessageQueue {
+public:
+    MessageQueue() {}
+    MessageQueue(MessageQueue const &) = delete;
+    MessageQueue &operator=(MessageQueue const &) = delete;
+    ~MessageQueue() {
+        Node *n = incoming.exchange(nullptr);
+        while (n != nullptr) {
+            Node *next = n->next;
+            delete n; n = next;
+        }
+    }
+    // Возвращает true, если до этого в стеке входящих не было сообщений
+    bool enqueue(Message const &msg) {
+        Node *n = new Node(msg);
+        n->next = incoming.load(memory_order_relaxed);
+        while (!incoming.compare_exchange_weak(n->next, n, memory_order_release, memory_order_relaxed))
+            ;
+        return n->next == nullptr;
+    }
+    Message dequeue() {
+        collect();
+        // top() возвращает константную ссылку, но элемент сразу удаляется - его можно переместить
+        Message ret = move(const_cast<Message &>(queue.top()));
+        queue.pop();
+        return ret;
+    }
+    Message peek() { 
+        collect();
+        return queue.top(); 
+    }
+    int size() { 
+        collect();
+        return (int)queue.size(); 
+    }
+    // Есть ли в очереди сообщение, которое пора доставить к моменту now
+    bool hasDue(int64 now) {
+        collect();
+        return !queue.empty() && queue.top().deliveryTime <= now;
+    }
+private:
+    struct Node {
+        Node(Message const &m) : msg(m) {}
+        Message msg;
+        Node *next = nullptr;
+    };
+    void collect() {
+        if (incoming.load(memory_order_relaxed) == nullptr) return;
+        Node *n = incoming.exchange(nullptr, memory_order_acquire);
+        while (n != nullptr) {
+            Node *next = n->next;
+            queue.push(move(n->msg));
+            delete n; n = next;
+        }
+    }
+    atomic<Node *> incoming{nullptr};
+    priority_queue<Message, vector<Message>, greater<Message> > queue;
+};
+
+// Иерархическое колесо таймеров. Уровень k состоит из 64 ячеек по 64^k тактов; таймер кладётся
+// на самый нижний уровень, где до него меньше 64 ячеек, и спускается на уровень ниже, когда
+// часы колеса доходят до его ячейки. Постановка и отмена таймера - O(1), срабатывание - O(1) на таймер.
+// Часы колеса могут перескакивать сразу к ближайшему таймеру (виртуальное время).
+// Таймер опознаётся ключом key (например, номер процесса и порядковый номер таймера).
+class TimerWheel {
+public:
+    TimerWheel() {
+        for (auto &h: heads) h = -1;
+        for (auto &c: levelCount) c = 0;
+    }
+    int size() const { return (int)byKey.size(); }
+    int64 now() const { return current; }
+    // Поставить таймер на момент expiry (не раньше now()). Повторный ключ заменяет старый таймер.
+    void arm(uint64 key, int64 expiry, Message const &m) {
+        cancel(key);
+        int n;
+        if (freeList.empty()) { n = (int)nodes.size(); nodes.emplace_back(); }
+        else { n = freeList.back(); freeList.pop_back(); }
+        nodes[n].key = key;
+        nodes[n].expiry = max(expiry, current);
+        nodes[n].msg = m;
+        byKey[key] = n;
+        link(n);
+        if (nextValid && (nextCached < 0 || nodes[n].expiry < nextCached)) nextCached = nodes[n].expiry;
+    }
+    bool cancel(uint64 key) {
+        auto it = byKey.find(key);
+        if (it == byKey.end()) return false;
+        int n = it->second;
+        byKey.erase(it);
+        if (nextValid && nodes[n].expiry == nextCached) nextValid = false;
+        unlink(n);
+        release(n);
+        return true;
+    }
+    // Время ближайшего таймера или -1
+    int64 nextExpiry() const {
+        if (nextValid) return nextCached;
+        int64 best = -1;
+        for (int k = 0; k < Levels; k++) {
+            if (levelCount[k] == 0) continue;
+            int64 block = shift(current, k);
+            for (int i = 0; i < Slots; i++) {
+                int n = heads[k * Slots + (int)((block + i) & (Slots - 1))];
+                if (n < 0) continue;
+                for (; n >= 0; n = nodes[n].next)
+                    if (best < 0 || nodes[n].expiry < best) best = nodes[n].expiry;
+                break;
             }
-            ptr++; return ret;
         }
-        throw std::logic_error("Expected string");
+        nextCached = best; nextValid = true;
+        return best;
     }
-    int getInt() {
-        if (ptr+4 < (int)body.size() && body[ptr] == (byte)MessageArg::IntType) {
-            unsigned ret = 0;
-            ptr++;
-            for (int i = 0; i <= 24; i+=8) {
-                ret |= (body[ptr++] & 0xFF) << i;
+    // Перевести часы на until, вызывая fire(Message &) для каждого таймера с expiry <= until
+    template<class F> void advance(int64 until, F fire) {
+        for (;;) {
+            int64 next = nextExpiry();
+            if (next < 0 || next > until) { jump(until); return; }
+            jump(next);
+            int &head = heads[(int)(next & (Slots - 1))];
+            while (head >= 0) {
+                int n = head;
+                unlink(n);
+                byKey.erase(nodes[n].key);
+                Message m = move(nodes[n].msg);
+                release(n);
+                nextValid = false;
+                fire(m);
             }
-            return (int)ret;
         }
-        throw std::logic_error("Expected int");
     }
-    int64 getInt64() {
-        if (ptr+8 < (int)body.size() && body[ptr] == (byte)MessageArg::Int64Type) {
-            uint64 ret = 0; ptr++;
-            for (int i = 0; i < 8; i++) {
-                ret = (ret <<= 8) | (body[ptr+7-i] & 0xFF);
+    // Обойти таймеры, не снимая их: f(key, expiry, Message const &)
+    template<class F> void forEach(F f) const {
+        for (auto const &kv: byKey) {
+            Node const &n = nodes[kv.second];
+            f(n.key, n.expiry, n.msg);
+        }
+    }
+    // Снять все таймеры (для переноса в другое колесо): fire(key, expiry, Message &)
+    template<class F> void drain(F fire) {
+        for (auto const &kv: byKey) {
+            Node &n = nodes[kv.second];
+            fire(n.key, n.expiry, n.msg);
+        }
+        *this = TimerWheel();
+    }
+private:
+    enum { Bits = 6, Slots = 1 << Bits, Levels = 11 };
+    struct Node {
+        int64 expiry = 0;
+        uint64 key = 0;
+        int prev = -1, next = -1, slot = -1;
+        Message msg = Message(-1, -1, Payload());
+    };
+    static int64 shift(int64 t, int level) { return t >> (Bits * level); }
+    void link(int n) {
+        int64 e = nodes[n].expiry;
+        int k = 0;
+        while (k < Levels - 1 && shift(e, k) - shift(current, k) >= Slots) k++;
+        int slot = k * Slots + (int)(shift(e, k) & (Slots - 1));
+        nodes[n].slot = slot;
+        nodes[n].prev = -1;
+        nodes[n].next = heads[slot];
+        if (heads[slot] >= 0) nodes[heads[slot]].prev = n;
+        heads[slot] = n;
+        levelCount[k]++;
+    }
+    void unlink(int n) {
+        Node &node = nodes[n];
+        if (node.prev >= 0) nodes[node.prev].next = node.next;
+        else heads[node.slot] = node.next;
+        if (node.next >= 0) nodes[node.next].prev = node.prev;
+        levelCount[node.slot / Slots]--;
+    }
+    void release(int n) {
+        nodes[n].msg = Message(-1, -1, Payload());
+        freeList.push_back(n);
+    }
+    // Перевести часы на t, если раньше t таймеров нет: таймеры из ячеек, в которые входят часы,
+    // спускаются на нижние уровни (сверху вниз, чтобы спущенные таймеры спускались дальше)
+    void jump(int64 t) {
+        if (t <= current) return;
+        int64 old = current;
+        current = t;
+        for (int k = Levels - 1; k > 0; k--) {
+            if (shift(old, k) == shift(t, k)) continue;
+            int slot = k * Slots + (int)(shift(t, k) & (Slots - 1));
+            int n = heads[slot];
+            heads[slot] = -1;
+            while (n >= 0) {
+                int next = nodes[n].next;
+                levelCount[k]--;
+                link(n);
+                n = next;
             }
-            ptr += 8;
-            return (int64)ret;
         }
-        throw std::logic_error("expected int64");
     }
-    bool operator>(Message const &oth) const {
-        return deliveryTime > oth.deliveryTime;
+    vector<Node> nodes;
+    vector<int> freeList;
+    unordered_map<uint64, int> byKey;
+    int heads[Levels * Slots];
+    int levelCount[Levels];
+    int64 current = 0;
+    mutable int64 nextCached = -1;
+    mutable bool nextValid = true;
+};
+
+// Пул исполнительных потоков фиксированного размера (по числу ядер) с перехватом работы (work stealing).
+// У каждого потока своя очередь задач: он берёт задачи с её конца, а простаивающие потоки
+// забирают задачи с начала чужих очередей. Потоки создаются при первой задаче, 
+// так что мир, работающий только в виртуальном времени, не создаёт ни одного потока.
+class WorkerPool {
+public:
+    using Task = function<void()>;
+    explicit WorkerPool(int threads = 0) : threadCount(threads) {
+        if (threadCount <= 0) threadCount = (int)thread::hardware_concurrency();
+        if (threadCount <= 0) threadCount = 1;
+    }
+    ~WorkerPool() { stop(); }
+    void submit(Task task) {
+        start();
+        int q = (current() == this) ? currentIndex() : (int)(nextQueue++ % (unsigned)threadCount);
+        {
+            lock_guard<mutex> ar(queues[q]->m);
+            queues[q]->tasks.push_back(move(task));
+        }
+        pending++;
+        lock_guard<mutex> ar(sleepMutex);
+        wakeup.notify_one();
+    }
+    // Остановить потоки. Задачи, которые ещё не начали исполняться, отбрасываются.
+    void stop() {
+        {
+            lock_guard<mutex> ar(sleepMutex);
+            if (threads.empty()) return;
+            stopFlag = true;
+            wakeup.notify_all();
+        }
+        for (auto &t: threads) t.join();
+        threads.clear();
+    }
+    // Выполнить fn(0) ... fn(n-1) потоками пула и дождаться завершения всех вызовов (барьер).
+    // Вызывающий поток тоже участвует в работе. Нельзя вызывать из задачи этого же пула.
+    void parallelFor(int n, function<void(int)> const &fn) {
+        int helpers = min(n, threadCount) - 1;
+        if (helpers <= 0) {
+            for (int i = 0; i < n; i++) fn(i);
+            return;
+        }
+        atomic<int> next{0};
+        int finished = 0;
+        mutex m;
+        condition_variable allDone;
+        auto body = [&] {
+            for (int i; (i = next++) < n; ) fn(i);
+        };
+        for (int h = 0; h < helpers; h++) {
+            submit([&] {
+                body();
+                lock_guard<mutex> ar(m);
+                if (++finished == helpers) allDone.notify_one();
+            });
+        }
+        body();
+        unique_lock<mutex> ar(m);
+        allDone.wait(ar, [&] { return finished == helpers; });
+    }
+    int size() const { return threadCount; }
+    bool running() {
+        lock_guard<mutex> ar(startMutex);
+        return !threads.empty();
+    }
+    // Изменить число потоков. Действует, только пока потоки ещё не созданы.
+    void setSize(int threads) {
+        lock_guard<mutex> ar(startMutex);
+        if (this->threads.empty() && threads > 0) threadCount = threads;
     }
 private:
-    void append(MessageArg const &a) {
-        for (byte b:  a.body) body.push_back(b);
+    struct WorkQueue {
+        mutex m;
+        deque<Task> tasks;
+    };
+    void start() {
+        lock_guard<mutex> ar(startMutex);
+        if (!threads.empty() || stopFlag) return;
+        for (int i = 0; i < threadCount; i++) queues.emplace_back(new WorkQueue);
+        for (int i = 0; i < threadCount; i++) threads.push_back(thread(workerExecutor, this, i));
     }
+    bool take(int index, Task &task) {
+        {
+            lock_guard<mutex> ar(queues[index]->m);
+            if (!queues[index]->tasks.empty()) {
+                task = move(queues[index]->tasks.back());
+                queues[index]->tasks.pop_back();
+                return true;
+            }
+        }
+        for (int i = 1; i < threadCount; i++) {
+            WorkQueue &victim = *queues[(index + i) % threadCount];
+            unique_lock<mutex> ar(victim.m, try_to_lock);
+            if (ar.owns_lock() && !victim.tasks.empty()) {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+    static void workerExecutor(WorkerPool *pool, int index) {
+        current() = pool; currentIndex() = index;
+        Task task;
+        while (true) {
+            if (pool->pending > 0 && pool->take(index, task)) {
+                pool->pending--;
+                task(); task = nullptr;
+                continue;
+            }
+            unique_lock<mutex> ar(pool->sleepMutex);
+            pool->wakeup.wait(ar, [pool] { return pool->stopFlag || pool->pending > 0; });
+            if (pool->stopFlag) break;
+        }
+    }
+    int threadCount;
+    vector<unique_ptr<WorkQueue> > queues;
+    vector<thread> threads;
+    atomic<int> pending{0};
+    atomic<unsigned> nextQueue{0};
+    mutex startMutex, sleepMutex;
+    condition_variable wakeup;
+    bool stopFlag = false;
+    // Пул и номер очереди текущего потока (nullptr, если поток не из пула)
+    static WorkerPool *&current() { static thread_local WorkerPool *p = nullptr; return p; }
+    static int &currentIndex() { static thread_local int i = 0; return i; }
 };
 
-class MessageQueue {
+// Соседи процесса: отрезок массива номеров, упорядоченный по возрастанию. Не выделяет память.
+// Для совместимости со старым кодом приводится к set<int> (с копированием).
+class Neighbors {
 public:
-    Message dequeue() {
-        lock_guard<recursive_mutex> ar(_mutex);
-        Message ret = queue.top();
-        queue.pop();
+    Neighbors(const int *b = nullptr, const int *e = nullptr, int firstEdge = 0) : b(b), e(e), firstEdge(firstEdge) {}
+    const int *begin() const { return b; }
+    const int *end() const { return e; }
+    int size() const { return (int)(e - b); }
+    bool empty() const { return b == e; }
+    int operator[](int i) const { return b[i]; }
+    const int *lower_bound(int node) const { return std::lower_bound(b, e, node); }
+    const int *upper_bound(int node) const { return std::upper_bound(b, e, node); }
+    const int *find(int node) const {
+        const int *p = lower_bound(node);
+        return (p != e && *p == node) ? p : e;
+    }
+    int count(int node) const { return find(node) != e ? 1 : 0; }
+    // Номер связи (см. Topology::latency) для соседа, на которого указывает it
+    int edge(const int *it) const { return firstEdge + (int)(it - b); }
+    operator set<int>() const { return set<int>(b, e); }
+private:
+    const int *b, *e;
+    int firstEdge;
+};
+
+// Модель сбоев связи. Потеря по модели Гилберта-Эллиотта: связь находится в хорошем или плохом 
+// состоянии; перед каждым сообщением она переходит из хорошего в плохое с вероятностью toBad и обратно 
+// с вероятностью toGood. В хорошем состоянии сообщение теряется с вероятностью loss, в плохом - badLoss.
+// Без burst (toBad = 0) связь всегда в хорошем состоянии, и потери независимы.
+struct LinkFault {
+    double loss = 0, dup = 0;               // вероятность потери и дублирования сообщения
+    int jitter = 0;                         // случайная добавка к задержке, 0..jitter тактов
+    double toBad = 0, toGood = 0, badLoss = 1;
+    bool none() const { return loss <= 0 && dup <= 0 && jitter <= 0 && toBad <= 0; }
+    bool operator==(LinkFault const &f) const {
+        return loss == f.loss && dup == f.dup && jitter == f.jitter && 
+            toBad == f.toBad && toGood == f.toGood && badLoss == f.badLoss;
+    }
+};
+
+// Замороженная топология сети в виде сжатых строк (CSR): связи процесса from занимают 
+// отрезок [offsets[from], offsets[from+1]) массивов targets и latency, targets в отрезке упорядочены.
+// Номер связи (edge) - индекс в этих массивах, по нему задержка берётся за O(1).
+// fault[edge] - номер модели сбоев связи в faults (0 - связь без сбоев), burst[edge] - состояние 
+// Гилберта-Эллиотта (1 - плохое). Состояние связи меняет только отправитель, то есть поток, исполняющий 
+// его обработчик, поэтому оно не требует синхронизации; при перестройке топологии оно сбрасывается.
+struct Topology {
+    vector<int> offsets, targets, latency, fault;
+    vector<LinkFault> faults;
+    mutable vector<byte> burst;
+#if DSSIMUL_STATS
+    mutable vector<LinkStats> linkStats;
+#endif
+    int size() const { return (int)offsets.size() - 1; }
+    Neighbors neighbors(int from) const {
+        if (from < 0 || from >= size()) return Neighbors();
+        const int *base = targets.data();
+        return Neighbors(base + offsets[from], base + offsets[from+1], offsets[from]);
+    }
+    // Номер связи from -> to или -1, если связи нет
+    int edge(int from, int to) const {
+        Neighbors n = neighbors(from);
+        const int *p = n.find(to);
+        return p == n.end() ? -1 : n.edge(p);
+    }
+};
+
+// Генератор случайных чисел SplitMix64: последовательность зависит только от зерна
+struct SplitMix {
+    uint64 x;
+    explicit SplitMix(uint64 seed) : x(seed) {}
+    uint64 next() {
+        uint64 z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        return z ^ (z >> 31);
+    }
+    // Равномерно в [0, 1)
+    double uniform() { return (double)(next() >> 11) * (1.0 / 9007199254740992.0); }
+};
+
+// Генератор топологии (директива "topology", NetworkLayer::generateTopology). Граф зависит только
+// от параметров и зерна и одинаков на любой платформе.
+//   ring n              - кольцо
+//   grid n [ширина]     - решётка по строкам заданной ширины (по умолчанию - корень из n)
+//   torus n [ширина]    - решётка с замкнутыми краями
+//   random-regular n [степень] - кольцо (для связности) и (степень - 2) случайных паросочетаний, 
+//                         повторные связи отбрасываются (по умолчанию степень 4)
+//   erdos-renyi n p     - каждая пара связана с вероятностью p; p > 1 - средняя степень
+//   scale-free n [m]    - модель Барабаши-Альберт: новый процесс связывается с m разными процессами,
+//                         выбранными пропорционально степени (по умолчанию m = 2)
+struct TopologySpec {
+    string kind;
+    int n = 0;
+    double param = 0;       // ширина, степень, p или m; 0 - по умолчанию
+    int latency = 1;
+    uint64 seed = 0;
+    // Неориентированные связи (a < b) без повторов
+    bool generate(vector<pair<int, int> > &edges) const {
+        edges.clear();
+        SplitMix rng(seed);
+        auto link = [&edges](int a, int b) { if (a != b) edges.push_back(make_pair(min(a, b), max(a, b))); };
+        if (kind == "ring") {
+            for (int i = 0; i < n; i++) link(i, (i + 1) % n);
+        } else if (kind == "grid" || kind == "torus") {
+            bool wrap = kind == "torus";
+            int w = param >= 1 ? (int)param : max(1, (int)sqrt((double)n));
+            for (int i = 0; i < n; i++) {
+                if ((i + 1) % w != 0 && i + 1 < n) link(i, i + 1);
+                else if (wrap) link(i, i - i % w);
+                if (i + w < n) link(i, i + w);
+                else if (wrap) link(i, i % w);
+            }
+        } else if (kind == "random-regular") {
+            int degree = param >= 1 ? (int)param : 4;
+            for (int i = 0; i < n; i++) link(i, (i + 1) % n);
+            vector<int> stubs;
+            for (int i = 0; i < n; i++)
+                for (int k = 0; k < degree - 2; k++) stubs.push_back(i);
+            for (size_t i = stubs.size(); i > 1; i--) swap(stubs[i - 1], stubs[rng.next() % i]);
+            for (size_t i = 0; i + 1 < stubs.size(); i += 2) link(stubs[i], stubs[i + 1]);
+        } else if (kind == "erdos-renyi") {
+            double p = param > 1 ? param / max(n - 1, 1) : param;
+            if (p >= 1) {
+                for (int a = 0; a < n; a++)
+                    for (int b = a + 1; b < n; b++) link(a, b);
+            } else if (p > 0) {
+                // Пропуск пар по геометрическому распределению (Батагель, Брандес): O(n + число связей)
+                double lp = log(1.0 - p);
+                int64 v = 1, w = -1;
+                while (v < n) {
+                    w += 1 + (int64)floor(log(1.0 - rng.uniform()) / lp);
+                    while (w >= v && v < n) { w -= v; v++; }
+                    if (v < n) link((int)v, (int)w);
+                }
+            }
+        } else if (kind == "scale-free") {
+            int m = param >= 1 ? (int)param : 2;
+            int core = min(n, m + 1);
+            // Концы всех связей: равномерный выбор из них - выбор процесса пропорционально степени
+            vector<int> ends;
+            for (int a = 0; a < core; a++)
+                for (int b = 0; b < a; b++) {
+                    link(a, b);
+                    ends.push_back(a);
+                    ends.push_back(b);
+                }
+            vector<int> chosen;
+            for (int v = core; v < n; v++) {
+                chosen.clear();
+                while ((int)chosen.size() < min(m, v)) {
+                    int t = ends[rng.next() % ends.size()];
+                    if (find(chosen.begin(), chosen.end(), t) == chosen.end()) chosen.push_back(t);
+                }
+                for (int t: chosen) {
+                    link(v, t);
+                    ends.push_back(v);
+                    ends.push_back(t);
+                }
+            }
+        } else return false;
+        // Решётка, Эрдёш-Реньи и Барабаши-Альберт не дают повторов, остальным нужна проверка
+        if (kind == "ring" || kind == "torus" || kind == "random-regular") {
+            sort(edges.begin(), edges.end());
+            edges.erase(unique(edges.begin(), edges.end()), edges.end());
+        }
+        return true;
+    }
+};
+
+// Двоичная трасса модели (директива "trace файл", World::startTrace): отправки, потери, таймеры, доставки 
+// и вызовы обработчиков. Файл - заголовок TraceHeader, массив записей TraceRecord одной длины и таблица 
+// имён типов сообщений; его можно отобразить в память (TraceFile) и разбирать как массив. Порядок байтов - машинный.
+// Каждый поток пишет в свой буфер и сбрасывает его в файл целиком, поэтому записи разных потоков идут блоками.
+// Порядок событий процесса восстанавливается по номеру доставки (value записи TraceDeliver).
+enum TraceKind { TraceSend = 1, TraceDrop, TraceTimer, TraceDeliver, TraceHandler, TraceData };
+
+struct TraceRecord {
+    byte kind = 0;          // TraceKind
+    byte flags = 0;         // Send: 1 - копия (dup); Drop: DropReason; Deliver: 1 - далее тело; Handler: 1 - обработано
+    uint16 thread = 0;      // номер потока (буфера) в трассе
+    int32 type = 0;         // номер типа сообщения, имя - в таблице типов файла
+    int32 from = 0, to = 0, origin = 0, size = 0;   // size - длина тела
+    int64 seq = 0;
+    int64 time = 0;         // now() в момент события
+    int64 value = 0;        // Send, Timer: deliveryTime; Deliver: номер доставки процессу; Handler: время обработчика, нс
+};
+
+// Тело сообщения извне (из файла конфигурации, *TIME) - в записях TraceData сразу за его TraceDeliver:
+// при воспроизведении остальные сообщения заново создают обработчики процессов
+struct TraceBody {
+    enum { Capacity = sizeof(TraceRecord) - 2 };
+    byte kind = TraceData, len = 0;
+    byte data[Capacity] = {};
+    static size_t records(size_t size) { return (size + Capacity - 1) / Capacity; }
+};
+static_assert(sizeof(TraceBody) == sizeof(TraceRecord), "trace records must have the same size");
+
+struct TraceHeader {
+    char magic[8] = {'D', 'S', 'S', 'T', 'R', 'A', 'C', 'E'};
+    uint32 version = 1, recordSize = sizeof(TraceRecord);
+    int64 records = 0;
+    // Таблица типов: uint32 число имён, затем для каждого uint32 длина и байты имени
+    int64 typesOffset = 0;
+    uint64 seed = 0;                // зерно потерь (lossSeed)
+    int32 mode = 0, processes = 0;
+    int64 startTick = 0, endTick = 0;
+    bool valid() const {
+        return memcmp(magic, TraceHeader().magic, sizeof magic) == 0 && version == 1 && recordSize == sizeof(TraceRecord);
+    }
+};
+
+class TraceWriter {
+public:
+    enum { BufferRecords = 4096 };
+    TraceWriter() : id(++lastId()) {}
+    ~TraceWriter() {
+        if (file != nullptr) fclose(file);
+    }
+    bool open(string const &name) {
+        file = fopen(name.c_str(), "wb");
+        TraceHeader h;
+        return file != nullptr && fwrite(&h, sizeof h, 1, file) == 1;
+    }
+    // Запись и, если body не пуст, тело сообщения следом за ней - в буфер текущего потока
+    void write(TraceRecord r, Payload const *body = nullptr) {
+        Buffer *b = local();
+        size_t n = 1 + (body != nullptr ? TraceBody::records(body->size()) : 0);
+        if (b->used + n > b->records.size()) {
+            flush(*b);
+            if (n > b->records.size()) b->records.resize(n);
+        }
+        r.thread = b->thread;
+        TraceRecord *out = &b->records[b->used];
+        out[0] = r;
+        for (size_t i = 1, pos = 0; i < n; i++) {
+            TraceBody t;
+            t.len = (byte)min<size_t>(TraceBody::Capacity, body->size() - pos);
+            memcpy(t.data, body->data() + pos, t.len);
+            memcpy((byte *)&out[i], &t, sizeof t);
+            pos += t.len;
+        }
+        b->used += n;
+    }
+    // Сбросить буферы всех потоков, дописать таблицу типов и заголовок, закрыть файл.
+    // Вызывается, когда обработчики не исполняются.
+    bool finish(TraceHeader h) {
+        if (file == nullptr) return false;
+        for (auto &b: buffers) flush(*b);
+        h.records = records;
+        h.typesOffset = (int64)sizeof h + records * (int64)sizeof(TraceRecord);
+        uint32 count = (uint32)MessageTypes::count();
+        ok = ok && fwrite(&count, sizeof count, 1, file) == 1;
+        for (uint32 i = 0; i < count; i++) {
+            string name = MessageTypes::name(i);
+            uint32 len = (uint32)name.size();
+            ok = ok && fwrite(&len, sizeof len, 1, file) == 1 && fwrite(name.data(), 1, len, file) == len;
+        }
+        ok = ok && fseek(file, 0, SEEK_SET) == 0 && fwrite(&h, sizeof h, 1, file) == 1;
+        ok = fclose(file) == 0 && ok;
+        file = nullptr;
+        return ok;
+    }
+private:
+    struct Buffer {
+        vector<TraceRecord> records = vector<TraceRecord>(BufferRecords);
+        size_t used = 0;
+        uint16 thread = 0;
+    };
+    // Буфер потока ищется под блокировкой только при первой записи потока в эту трассу
+    Buffer *local() {
+        struct Slot { uint64 owner = 0; Buffer *buffer = nullptr; };
+        static thread_local Slot slot;
+        if (slot.owner == id) return slot.buffer;
+        lock_guard<mutex> ar(buffersMutex);
+        Buffer *&b = byThread[this_thread::get_id()];
+        if (b == nullptr) {
+            buffers.emplace_back(new Buffer);
+            b = buffers.back().get();
+            b->thread = (uint16)(buffers.size() - 1);
+        }
+        slot.owner = id;
+        slot.buffer = b;
+        return b;
+    }
+    void flush(Buffer &b) {
+        if (b.used == 0) return;
+        lock_guard<mutex> ar(fileMutex);
+        ok = ok && fwrite(b.records.data(), sizeof(TraceRecord), b.used, file) == b.used;
+        records += (int64)b.used;
+        b.used = 0;
+    }
+    // Номер трассы для кэша потока: адрес удалённой трассы может достаться новой
+    static atomic<uint64> &lastId() { static atomic<uint64> n{0}; return n; }
+    const uint64 id;
+    FILE *file = nullptr;
+    bool ok = true;
+    int64 records = 0;
+    mutex buffersMutex, fileMutex;
+    vector<unique_ptr<Buffer> > buffers;
+    unordered_map<thread::id, Buffer *> byThread;
+};
+
+// Файл, отображённый в память только для чтения (в Windows - прочитанный целиком)
+class MappedFile {
+public:
+    MappedFile() {}
+    MappedFile(MappedFile const &) = delete;
+    ~MappedFile() { close(); }
+    bool open(string const &name) {
+        close();
+#ifndef _WIN32
+        int fd = ::open(name.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        bool ok = fstat(fd, &st) == 0;
+        if (ok && st.st_size > 0) {
+            void *p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = p != MAP_FAILED;
+            if (ok) {
+                mapped = (const byte *)p;
+                length = (size_t)st.st_size;
+            }
+        }
+        ::close(fd);
+        return ok;
+#else
+        FILE *f = fopen(name.c_str(), "rb");
+        if (f == nullptr) return false;
+        byte chunk[65536];
+        for (size_t n; (n = fread(chunk, 1, sizeof chunk, f)) > 0; ) copy.insert(copy.end(), chunk, chunk + n);
+        fclose(f);
+        mapped = copy.data();
+        length = copy.size();
+        return true;
+#endif
+    }
+    void close() {
+#ifndef _WIN32
+        if (mapped != nullptr) munmap((void *)mapped, length);
+#else
+        copy.clear();
+#endif
+        mapped = nullptr;
+        length = 0;
+    }
+    const byte *data() const { return mapped; }
+    size_t size() const { return length; }
+private:
+    const byte *mapped = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    bytevector copy;
+#endif
+};
+
+// Снимок модели (World::checkpoint): заголовок, затем разделы подряд - топология, процессы с рабочими 
+// функциями, контексты, сообщения в пути, таймеры. Числа записываются в порядке байт машины, как в трассе,
+// сообщение - запись CheckpointMessage и тело; номера типов по телу определяются заново.
+struct CheckpointHeader {
+    char magic[8] = {'D', 'S', 'S', 'C', 'K', 'P', 'T', 0};
+    uint32 version = 2, headerSize = sizeof(CheckpointHeader);
+    int32 mode = 0, processes = 0;
+    int64 tick = 0, externalSeq = 0;
+    uint64 baseSeed = 0, seedStream = 0;
+    double errorRate = 0;
+    bool valid() const {
+        return memcmp(magic, CheckpointHeader().magic, sizeof magic) == 0 && version == 2 && headerSize == sizeof(CheckpointHeader);
+    }
+};
+
+struct CheckpointMessage {
+    int64 sendTime, deliveryTime, seq;
+    int32 from, to, origin;
+    uint32 size;
+};
+
+class CheckpointWriter {
+public:
+    template<class T> void put(T const &v) { putBytes(&v, sizeof v); }
+    void putBytes(const void *p, size_t n) { out.insert(out.end(), (const byte *)p, (const byte *)p + n); }
+    void putString(string const &v) {
+        put((uint32)v.size());
+        putBytes(v.data(), v.size());
+    }
+    void putMessage(Message const &m) {
+        CheckpointMessage r = {m.sendTime, m.deliveryTime, m.seq, m.from, m.to, m.origin, (uint32)m.body.size()};
+        put(r);
+        putBytes(m.body.data(), m.body.size());
+    }
+    bool save(string const &name) const {
+        FILE *f = fopen(name.c_str(), "wb");
+        if (f == nullptr) return false;
+        bool ok = fwrite(out.data(), 1, out.size(), f) == out.size();
+        return fclose(f) == 0 && ok;
+    }
+private:
+    bytevector out;
+};
+
+// Чтение снимка; после первой ошибки (файл короче ожидаемого) все get возвращают false
+class CheckpointReader {
+public:
+    bool open(string const &name) { return file.open(name); }
+    template<class T> bool get(T &v) { return getBytes(&v, sizeof v); }
+    bool getBytes(void *p, size_t n) {
+        if (!ok || file.size() - pos < n) return ok = false;
+        memcpy(p, file.data() + pos, n);
+        pos += n;
+        return true;
+    }
+    bool skip(size_t n) {
+        if (!ok || file.size() - pos < n) return ok = false;
+        pos += n;
+        return true;
+    }
+    bool getString(string &v) {
+        uint32 n;
+        if (!get(n) || file.size() - pos < n) return ok = false;
+        v.assign((const char *)file.data() + pos, n);
+        pos += n;
+        return true;
+    }
+    bool getMessage(Message &m) {
+        CheckpointMessage r;
+        if (!get(r) || file.size() - pos < r.size) return ok = false;
+        m = Message(r.from, r.to, Payload(file.data() + pos, r.size));
+        pos += r.size;
+        m.sendTime = r.sendTime;
+        m.deliveryTime = r.deliveryTime;
+        m.seq = r.seq;
+        m.origin = r.origin;
+        return true;
+    }
+    bool good() const { return ok; }
+private:
+    MappedFile file;
+    size_t pos = 0;
+    bool ok = true;
+};
+
+// Трасса, отображённая в память
+class TraceFile {
+public:
+    TraceFile() {}
+    TraceFile(TraceFile const &) = delete;
+    bool open(string const &name) {
+        close();
+        if (!file.open(name)) return false;
+        data = file.data();
+        length = file.size();
+        if (length < sizeof(TraceHeader) || !header().valid() || header().records < 0 ||
+            header().typesOffset != (int64)sizeof(TraceHeader) + header().records * (int64)sizeof(TraceRecord) ||
+            (uint64)header().typesOffset + 4 > length || !readTypes()) {
+            close();
+            return false;
+        }
+        return true;
+    }
+    void close() {
+        file.close();
+        data = nullptr;
+        length = 0;
+        types.clear();
+    }
+    TraceHeader const &header() const { return *(const TraceHeader *)data; }
+    size_t size() const { return (size_t)header().records; }
+    const TraceRecord *begin() const { return (const TraceRecord *)(data + sizeof(TraceHeader)); }
+    const TraceRecord *end() const { return begin() + size(); }
+    TraceRecord const &operator[](size_t i) const { return begin()[i]; }
+    // Тело, записанное за записью i (TraceDeliver с флагом 1). Возвращает false, если записи тела 
+    // повреждены или трасса обрывается раньше.
+    bool body(size_t i, Payload &p) const {
+        if (begin()[i].size < 0) return false;
+        size_t n = (size_t)begin()[i].size, last = i + 1 + TraceBody::records(n);
+        if (last > size()) return false;
+        byte *out = p.allocate(n);
+        size_t pos = 0;
+        for (size_t k = i + 1; k < last; k++) {
+            TraceBody t;
+            memcpy((byte *)&t, &begin()[k], sizeof t);
+            if (t.kind != TraceData || t.len == 0 || t.len > TraceBody::Capacity || t.len > n - pos) return false;
+            memcpy(out + pos, t.data, t.len);
+            pos += t.len;
+        }
+        return pos == n;
+    }
+    // Имя типа сообщения записанного прогона
+    string typeName(int type) const {
+        return type >= 0 && type < (int)types.size() ? types[type] : string();
+    }
+    vector<string> const &typeNames() const { return types; }
+private:
+    bool readTypes() {
+        const byte *p = data + header().typesOffset, *last = data + length;
+        uint32 count;
+        memcpy(&count, p, 4);
+        p += 4;
+        for (uint32 i = 0; i < count; i++) {
+            uint32 len;
+            if (last - p < 4) return false;
+            memcpy(&len, p, 4);
+            p += 4;
+            if ((size_t)(last - p) < len) return false;
+            types.push_back(string((const char *)p, len));
+            p += len;
+        }
+        return true;
+    }
+    MappedFile file;
+    const byte *data = nullptr;
+    size_t length = 0;
+    vector<string> types;
+};
+
+// Сообщение в трассе и при воспроизведении: отправитель, получатель и номер у отправителя
+struct TraceKey {
+    int origin, to;
+    int64 seq;
+    bool operator==(TraceKey const &k) const { return origin == k.origin && to == k.to && seq == k.seq; }
+};
+struct TraceKeyHash {
+    size_t operator()(TraceKey const &k) const {
+        uint64 x = ((uint64)(uint32)k.origin << 32 | (uint32)k.to) ^ ((uint64)k.seq * 0x9E3779B97F4A7C15ULL);
+        return (size_t)(x ^ (x >> 29));
+    }
+};
+
+// Воспроизведение трассы (режим Replay). Каждый процесс получает те же сообщения в том же порядке и
+// при тех же показаниях часов, что и в записанном прогоне, а потери повторяются по трассе. Сообщения 
+// извне берутся из трассы, сообщения процессов заново создают их обработчики. Процессы продвигаются
+// независимо: очередная доставка выполняется, как только её сообщение отправлено, поэтому порядок работы
+// разных процессов может отличаться от записанного (в режиме RealTime он и не определён), но причинность сохраняется.
+struct ReplayLog {
+    struct Delivery {
+        TraceKey key;
+        int64 time, index;
+        int type;
+    };
+    vector<vector<Delivery> > deliveries;                       // по процессам, в порядке доставки
+    unordered_map<TraceKey, int, TraceKeyHash> drops;           // потерянное сообщение -> DropReason
+    unordered_map<TraceKey, int, TraceKeyHash> expected;        // сколько копий сообщения ещё будет доставлено
+    unordered_map<TraceKey, Message, TraceKeyHash> pending;     // отправлено и ждёт доставки
+    unordered_map<TraceKey, int, TraceKeyHash> waiting;         // ещё не отправленное сообщение -> ждущий его процесс
+    using ReadyEntry = pair<int64, int>;
+    priority_queue<ReadyEntry, vector<ReadyEntry>, greater<ReadyEntry> > ready;     // (время доставки, процесс)
+    vector<size_t> cursor;
+    vector<string> types;
+    int64 startTick = 0, remaining = 0;
+    bool diverged = false;
+    bool load(TraceFile const &f) {
+        types = f.typeNames();
+        startTick = f.header().startTick;
+        for (size_t i = 0; i < f.size(); i++) {
+            TraceRecord const &r = f[i];
+            TraceKey key = {r.origin, r.to, r.seq};
+            if (r.kind == TraceDrop) drops[key] = r.flags;
+            if (r.kind != TraceDeliver) continue;
+            if (r.to < 0) return false;
+            if (r.to >= (int)deliveries.size()) deliveries.resize(r.to + 1);
+            deliveries[r.to].push_back(Delivery{key, r.time, r.value, r.type});
+            expected[key]++;
+            remaining++;
+            if (r.flags & 1) {
+                Payload body;
+                if (!f.body(i, body)) return false;
+                Message m(r.from, r.to, body);
+                m.origin = r.origin;
+                m.seq = r.seq;
+                m.sendTime = m.deliveryTime = r.time;
+                pending.emplace(key, m);
+                i += TraceBody::records(r.size);
+            }
+        }
+        cursor.assign(deliveries.size(), 0);
+        for (int node = 0; node < (int)deliveries.size(); node++) {
+            auto &d = deliveries[node];
+            sort(d.begin(), d.end(), [](Delivery const &a, Delivery const &b) { return a.index < b.index; });
+            schedule(node);
+        }
+        return true;
+    }
+    // Следующая доставка процесса готова, если её сообщение уже отправлено, иначе процесс ждёт его
+    void schedule(int node) {
+        if (cursor[node] >= deliveries[node].size()) return;
+        Delivery const &d = deliveries[node][cursor[node]];
+        if (pending.count(d.key)) ready.push(ReadyEntry(d.time, node));
+        else waiting[d.key] = node;
+    }
+    // Сообщение отправлено обработчиком; сообщения, не доставленные в записанном прогоне, не нужны
+    void post(Message const &m) {
+        TraceKey key = {m.origin, m.to, m.seq};
+        auto e = expected.find(key);
+        if (e == expected.end() || e->second == 0) return;
+        pending.emplace(key, m);
+        auto w = waiting.find(key);
+        if (w != waiting.end()) {
+            int node = w->second;
+            waiting.erase(w);
+            schedule(node);
+        }
+    }
+};
+
+#ifdef _WIN32
+class ShardTransport {};
+#else
+// Транспорт шардов (см. NetworkLayer::setShards): общая память, отображённая в процессы ОС до fork().
+// На каждую упорядоченную пару шардов - кольцевой буфер с одним писателем и одним читателем, 
+// в нём записи ShardRecord с телом сообщения. В заголовке - барьер окна и итоги шардов перед окном.
+class ShardTransport {
+public:
+    enum { MaxShards = 64, RingBytes = 1 << 20 };
+    // Итог шарда перед окном: время ближайшего события, часы, число событий, нет ли событий и таймеров
+    struct Summary {
+        int64 next, clock, handled;
+        int32 idle;
+    };
+    ShardTransport() {}
+    ShardTransport(ShardTransport const &) = delete;
+    ~ShardTransport() {
+        if (header != nullptr) munmap(header, bytes);
+    }
+    bool create(int count) {
+        if (count < 2 || count > MaxShards) return false;
+        bytes = sizeof(Header) + (size_t)count * count * (sizeof(Ring) + RingBytes);
+        void *p = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED) return false;
+        header = new (p) Header();
+        header->count = count;
+        header->pids[0] = getpid();
+        for (int i = 0; i < count * count; i++) new (ring(i)) Ring();
+        return true;
+    }
+    int count() const { return header->count; }
+    int index() const { return shard; }
+    // Породить шарды 1..count-1; возвращает номер шарда вызвавшего процесса (родитель - шард 0) или -1
+    int fork() {
+        for (int i = 1; i < count(); i++) {
+            pid_t pid = ::fork();
+            if (pid < 0) return -1;
+            if (pid == 0) return shard = i;
+            header->pids[i] = pid;
+        }
+        return shard = 0;
+    }
+    // Шард 0 дожидается остальных
+    void join() {
+        if (shard != 0) return;
+        for (int i = 1; i < count(); i++) 
+            if (header->pids[i] > 0) waitpid(header->pids[i], nullptr, 0);
+    }
+    // Записать сообщение в буфер к шарду dst; false - буфер полон
+    bool push(int dst, Message const &m) {
+        Ring &r = *ring(shard * count() + dst);
+        size_t n = recordBytes(m.body.size());
+        uint64 head = r.head.load(memory_order_relaxed);
+        if (head + n - r.tail.load(memory_order_acquire) > RingBytes) return false;
+        ShardRecord rec = {m.sendTime, m.deliveryTime, m.seq, m.from, m.to, m.origin, (uint32)m.body.size()};
+        copyIn(r, head, &rec, sizeof rec);
+        copyIn(r, head + sizeof rec, m.body.data(), m.body.size());
+        r.head.store(head + n, memory_order_release);
+        return true;
+    }
+    // Сообщение не поместится в буфер никогда
+    static bool fits(Message const &m) { return recordBytes(m.body.size()) <= RingBytes; }
+    // Забрать все сообщения, пришедшие этому шарду: f(Message &&)
+    template<class F> void receive(F f) {
+        for (int src = 0; src < count(); src++) {
+            if (src == shard) continue;
+            Ring &r = *ring(src * count() + shard);
+            uint64 tail = r.tail.load(memory_order_relaxed), head = r.head.load(memory_order_acquire);
+            while (tail < head) {
+                ShardRecord rec;
+                copyOut(r, tail, &rec, sizeof rec);
+                Payload body;
+                copyOut(r, tail + sizeof rec, body.allocate(rec.size), rec.size);
+                tail += recordBytes(rec.size);
+                // Номера типов у шардов могут различаться: тип заново определяется по телу
+                Message m(rec.from, rec.to, body);
+                m.sendTime = rec.sendTime;
+                m.deliveryTime = rec.deliveryTime;
+                m.seq = rec.seq;
+                m.origin = rec.origin;
+                f(move(m));
+            }
+            r.tail.store(tail, memory_order_release);
+        }
+    }
+    // Барьер всех шардов. Пока ждём, вызывается idle(): он должен забирать входящие сообщения, 
+    // иначе шард, ждущий места в нашем буфере, не дойдёт до барьера.
+    template<class F> void barrier(F idle) {
+        uint32 gen = header->generation.load(memory_order_acquire);
+        if (header->arrived.fetch_add(1, memory_order_acq_rel) + 1 == (uint32)count()) {
+            header->arrived.store(0, memory_order_relaxed);
+            header->generation.fetch_add(1, memory_order_release);
+            wakeAll(header->generation);
+            return;
+        }
+        for (int spin = 0; header->generation.load(memory_order_acquire) == gen; spin++) {
+            idle();
+            if (spin < 64) this_thread::yield();
+            else {
+                waitChange(header->generation, gen);
+                if (header->generation.load(memory_order_acquire) == gen) checkPeers();
+            }
+        }
+    }
+    // Ожидание места в буфере
+    void backoff(int spin) {
+        if (spin < 64) this_thread::yield();
+        else {
+            this_thread::sleep_for(chrono::microseconds(50));
+            if (spin % 256 == 0) checkPeers();
+        }
+    }
+    // Итоги шардов раунда round (два набора по чётности: следующий раунд не затирает читаемый)
+    Summary &summary(int64 round, int shardIndex) { return header->summaries[round & 1][shardIndex]; }
+private:
+    struct ShardRecord {
+        int64 sendTime, deliveryTime, seq;
+        int32 from, to, origin;
+        uint32 size;
+    };
+    struct Header {
+        atomic<uint32> arrived{0}, generation{0};
+        int count = 0;
+        pid_t pids[MaxShards] = {};
+        Summary summaries[2][MaxShards];
+    };
+    // Позиции - счётчики байт за всё время; писатель и читатель на разных строках кэша
+    struct Ring {
+        atomic<uint64> head{0};
+        char pad1[64 - sizeof(atomic<uint64>)];
+        atomic<uint64> tail{0};
+        char pad2[64 - sizeof(atomic<uint64>)];
+        byte *data() { return (byte *)(this + 1); }
+    };
+    static size_t recordBytes(size_t size) { return (sizeof(ShardRecord) + size + 7) & ~(size_t)7; }
+    Ring *ring(int i) const { 
+        return (Ring *)((byte *)header + sizeof(Header) + (size_t)i * (sizeof(Ring) + RingBytes)); 
+    }
+    static void copyIn(Ring &r, uint64 pos, const void *src, size_t n) {
+        size_t at = (size_t)(pos % RingBytes), first = min(n, (size_t)RingBytes - at);
+        memcpy(r.data() + at, src, first);
+        memcpy(r.data(), (const byte *)src + first, n - first);
+    }
+    static void copyOut(Ring &r, uint64 pos, void *dst, size_t n) {
+        size_t at = (size_t)(pos % RingBytes), first = min(n, (size_t)RingBytes - at);
+        memcpy(dst, r.data() + at, first);
+        memcpy((byte *)dst + first, r.data(), n - first);
+    }
+    // Ждать изменения слова (не дольше миллисекунды) и разбудить ждущих; futex работает и между процессами
+    static void waitChange(atomic<uint32> &word, uint32 value) {
+#ifdef __linux__
+        struct timespec timeout = {0, 1000000};
+        syscall(SYS_futex, (uint32 *)&word, FUTEX_WAIT, value, &timeout, nullptr, 0);
+#else
+        (void)word; (void)value;
+        this_thread::sleep_for(chrono::microseconds(50));
+#endif
+    }
+    static void wakeAll(atomic<uint32> &word) {
+#ifdef __linux__
+        syscall(SYS_futex, (uint32 *)&word, FUTEX_WAKE, numeric_limits<int>::max(), nullptr, nullptr, 0);
+#else
+        (void)word;
+#endif
+    }
+    // Шард завершился раньше времени - остальные не дождутся его на барьере
+    void checkPeers() {
+        bool lost = false;
+        if (shard != 0) lost = getppid() != header->pids[0];
+        else for (int i = 1; i < count() && !lost; i++) lost = waitpid(header->pids[i], nullptr, WNOHANG) != 0;
+        if (!lost) return;
+        fprintf(stderr, "shard %d: another shard exited, stopping\n", shard);
+        _exit(1);
+    }
+    Header *header = nullptr;
+    size_t bytes = 0;
+    int shard = 0;
+};
+#endif
+
+// Тип контекста рабочей функции (см. contextes.h): номер типа и способ создать и удалить контекст
+// в памяти ContextArray. Номера выдаются при первом обращении к ContextType::of<T>() и общие для всех миров.
+// Тип можно копировать побайтно (контексты в снимке модели). В libstdc++ g++ 4.9 ещё нет 
+// std::is_trivially_copyable, поэтому g++ до 5 и clang спрашивают сам компилятор.
+template<class T> struct TriviallyCopyable {
+#if defined(__clang__)
+    static const bool value = __is_trivially_copyable(T);
+#elif defined(__GNUC__) && __GNUC__ < 5
+    static const bool value = __has_trivial_copy(T) && __has_trivial_assign(T) && __has_trivial_destructor(T);
+#else
+    static const bool value = is_trivially_copyable<T>::value;
+#endif
+};
+
+// Имя типа (typeid) связывает контексты снимка (World::checkpoint) с типами программы, которая его читает;
+// в снимок попадают только тривиально копируемые контексты.
+struct ContextType {
+    int id;
+    size_t size;
+    const char *name;
+    bool trivial;
+    void (*construct)(void *p);
+    void (*destroy)(void *p);
+    template<class T> static ContextType const &of() {
+        static ContextType const &type = add(ContextType{0, sizeof(T), typeid(T).name(), 
+            TriviallyCopyable<T>::value, [](void *p) { new (p) T(); }, [](void *p) { ((T *)p)->~T(); }});
+        return type;
+    }
+    // Все типы, к которым программа уже обращалась
+    static vector<ContextType const *> all() {
+        lock_guard<mutex> lock(registryMutex());
+        vector<ContextType const *> ret;
+        for (auto const &t: registry()) ret.push_back(t.get());
         return ret;
     }
-    void enqueue(Message const &msg) {
-        lock_guard<recursive_mutex> ar(_mutex);
-        queue.push(msg);
+    static ContextType const *find(string const &name) {
+        for (auto t: all()) 
+            if (name == t->name) return t;
+        return nullptr;
     }
-    Message peek() const { return queue.top(); }
-    int size() const { return (int)queue.size(); }
 private:
-    priority_queue<Message, vector<Message>, greater<Message> > queue;
-    recursive_mutex _mutex;
+    static ContextType const &add(ContextType t) {
+        lock_guard<mutex> lock(registryMutex());
+        t.id = (int)registry().size();
+        registry().emplace_back(new ContextType(t));
+        return *registry().back();
+    }
+    static vector<unique_ptr<ContextType> > &registry() {
+        static vector<unique_ptr<ContextType> > types;
+        return types;
+    }
+    static mutex &registryMutex() {
+        static mutex m;
+        return m;
+    }
+};
+
+// Контексты одного типа всех процессов, которым они нужны. Лежат подряд блоками по BlockSize штук,
+// поэтому обход контекстов не прыгает по памяти процессов. Блоки не перемещаются при росте:
+// процесс хранит прямой указатель на свой контекст, и новый контекст можно добавить во время работы модели.
+class ContextArray {
+public:
+    enum { BlockSize = 1024 };
+    explicit ContextArray(ContextType const &t) : type(t) {}
+    ContextArray(ContextArray const &) = delete;
+    ContextArray &operator=(ContextArray const &) = delete;
+    ~ContextArray() {
+        for (size_t i = 0; i < nodes.size(); i++) type.destroy(at(i));
+        for (auto b: blocks) ::operator delete(b);
+    }
+    // Новый контекст процесса node (конструктор по умолчанию)
+    void *add(int node) {
+        size_t i = nodes.size();
+        if (i % BlockSize == 0) blocks.push_back((char *)::operator new(type.size * BlockSize));
+        void *p = at(i);
+        type.construct(p);
+        nodes.push_back(node);
+        return p;
+    }
+    size_t size() const { return nodes.size(); }
+    void *at(size_t i) const { return blocks[i / BlockSize] + (i % BlockSize) * type.size; }
+    // Процесс, которому принадлежит i-й контекст
+    int node(size_t i) const { return nodes[i]; }
+private:
+    ContextType const &type;
+    vector<char *> blocks;
+    vector<int> nodes;
 };
 
 class Process;
+using EventCalendar = priority_queue<Message, vector<Message>, greater<Message> >;
 // Сетевая инфраструктура. Каждый процесс должен зарегистрироваться в ней.
 // Она также регистрирует связи между процессами и посылает сообшения процессам.
 class NetworkLayer
 {
 public:
     ~NetworkLayer() {
-        stopFlag = true; globalTimer.join();
+        shutdown();
+    }
+    // Остановить глобальный таймер и пул потоков. Вызывается до удаления процессов.
+    void shutdown() {
+        {
+            lock_guard<mutex> ar(timerSleepMutex);
+            stopFlag = true;
+            timerSleep->notify_all();
+        }
+        if (globalTimer.joinable()) globalTimer.join();
+        for (auto &t: tickerThreads) t.join();
+        tickerThreads.clear();
+        pool.stop();
+        stopTrace();
+#ifndef _WIN32
+        if (transport != nullptr) transport->join();
+#endif
+    }
+    // Режимы моделирования времени.
+    // RealTime - такт (tick) отсчитывается по системным часам в секундах, обработчики процессов 
+    //   исполняются общим пулом потоков (WorkerPool), когда у процесса появляется сообщение к доставке.
+    // Virtual - единые виртуальные часы и общий календарь событий: моделирование не ждёт,
+    //   а сразу переходит к ближайшему deliveryTime. Обработчики вызываются в потоке, вызвавшем runUntil().
+    // Synchronous - синхронный режим по тактам (раундам): сообщения, отправленные в раунде tick, доставляются
+    //   в начале раунда tick+1 независимо от задержки связи. Обработчики раунда исполняются пулом параллельно,
+    //   между раундами - барьер.
+    // Parallel - виртуальное время с консервативным параллельным моделированием: процессы разбиты на части
+    //   по числу потоков пула, каждая часть со своим календарём обрабатывает события в окне [T, T + lookahead),
+    //   где lookahead - минимальная задержка связи между частями. Порядок событий каждого процесса
+    //   совпадает с режимом Virtual.
+    // Replay - воспроизведение записанной трассы (startReplay, см. ReplayLog) в потоке, вызвавшем runUntil().
+    enum Mode { RealTime, Virtual, Synchronous, Parallel, Replay };
+    void setMode(int m) {
+        lock_guard<recursive_mutex> ar(globalTimerMutex);
+        mode = m;
+        if (mode != RealTime) tick = 0;
     }
+    int mode = RealTime;
+    // Шарды (режимы Virtual и Parallel, только POSIX): процессы модели делятся на count отрезков подряд идущих 
+    // номеров, и каждый отрезок исполняет свой процесс ОС. Шарды порождаются fork() при первом запуске модели,
+    // поэтому всё построенное до него (топология, процессы, контексты) они делят по копированию при записи.
+    // Сообщения в другой шард идут через кольцевые буферы в общей памяти (ShardTransport), время - окнами 
+    // шириной в минимальную задержку связи между шардами, как в режиме Parallel. Каждый шард выводит сообщения 
+    // своих процессов и пишет их статистику (World::dumpStats); трасса с шардами не пишется.
+    void setShards(int count) { shardCount = max(count, 1); }
+    int shardIndex() const { return shard; }
+    bool sharded() const { return transport != nullptr; }
+    // Процесс node исполняется этим шардом (без шардов - любой)
+    bool owns(int node) const { return transport == nullptr || partitionOf(node) == shard; }
     // Моделируется асинхронный режим. Сообщения посылаются процессу немедленно и
     // доставляются через время, указанное в свойствах связи. Процесс принимает 
     // сообщения независимо от показания глобальных часов и от других процессов. 
     void setErrorRate(double rate) { errorRate = rate; }
-    void createLink(int from, int to, bool bidirectional = true, int cost = 0) {
-        if (from == to) return;
-        networkMap[from][to] = cost;
-        if (bidirectional) networkMap[to][from] = cost;
+    // Изменения топологии накапливаются в списке links (повторная связь заменяет прежнюю), а замороженное 
+    // представление (Topology) перестраивается один раз при первом обращении после изменений. Менять связи 
+    // можно и во время работы модели: выданные обработчику Neighbors действительны до его завершения.
+    // Связи с отрицательной задержкой не создаются: они сломали бы окна lookahead и порядок календаря.
+    // fault - номер модели сбоев связи (faultModel), хранится в самой связи; 0 - без сбоев.
+    void createLink(int from, int to, bool bidirectional = true, int cost = 0, int fault = 0) {
+        if (from == to || from < 0 || to < 0 || cost < 0) return;
+        lock_guard<mutex> ar(topologyMutex);
+        links.push_back(Link{from, to, cost, fault});
+        if (bidirectional) links.push_back(Link{to, from, cost, fault});
+        topologyDirty = true;
+    }
+    // Много связей сразу (генераторы топологий, импорт списка связей): одна блокировка на все
+    void createLinks(vector<pair<int, int> > const &edges, bool bidirectional = true, int cost = 0, int fault = 0) {
+        if (cost < 0) return;
+        lock_guard<mutex> ar(topologyMutex);
+        links.reserve(links.size() + edges.size() * (bidirectional ? 2 : 1));
+        for (auto const &e: edges) {
+            if (e.first == e.second || e.first < 0 || e.second < 0) continue;
+            links.push_back(Link{e.first, e.second, cost, fault});
+            if (bidirectional) links.push_back(Link{e.second, e.first, cost, fault});
+        }
+        topologyDirty = true;
+    }
+    // Сгенерировать топологию (см. TopologySpec) и создать её связи. Возвращает число неориентированных 
+    // связей без повторов или -1 для неизвестного вида и отрицательной задержки.
+    int64 generateTopology(TopologySpec const &spec, bool bidirectional = true) {
+        vector<pair<int, int> > edges;
+        if (spec.latency < 0 || !spec.generate(edges)) return -1;
+        createLinks(edges, bidirectional, spec.latency);
+        return (int64)edges.size();
+    }
+    // Двоичный список связей: пары int32 (from, to) или, при weighted, тройки (from, to, latency)
+    // в машинном порядке байтов. Файл отображается в память и читается без разбора текста.
+    // Возвращает число записей, -1 (файл не читается) или -2 (отрицательная задержка - тогда связи 
+    // из файла не создаются); nodes - наибольший номер процесса + 1.
+    int64 importLinks(string const &name, bool weighted, bool bidirectional, int latency, int &nodes) {
+        MappedFile f;
+        size_t size = weighted ? 3 * sizeof(int32) : 2 * sizeof(int32);
+        nodes = 0;
+        if (!f.open(name) || f.size() % size != 0) return -1;
+        size_t count = f.size() / size;
+        if (latency < 0) return -2;
+        for (size_t i = 0; weighted && i < count; i++) {
+            int32 w;
+            memcpy(&w, f.data() + i * size + 2 * sizeof(int32), sizeof w);
+            if (w < 0) return -2;
+        }
+        lock_guard<mutex> ar(topologyMutex);
+        links.reserve(links.size() + count * (bidirectional ? 2 : 1));
+        for (size_t i = 0; i < count; i++) {
+            int32 v[3] = {0, 0, latency};
+            memcpy(v, f.data() + i * size, size);
+            if (v[0] < 0 || v[1] < 0) continue;
+            nodes = max(nodes, max(v[0], v[1]) + 1);
+            if (v[0] == v[1]) continue;
+            links.push_back(Link{v[0], v[1], v[2], 0});
+            if (bidirectional) links.push_back(Link{v[1], v[0], v[2], 0});
+        }
+        topologyDirty = true;
+        return (int64)count;
+    }
+    // Номер модели сбоев f для создания связей (0 - без сбоев). Одинаковые модели делят один номер, 
+    // поэтому директива link регистрирует модель один раз на все свои связи.
+    int faultModel(LinkFault const &f) {
+        if (f.none()) return 0;
+        lock_guard<mutex> ar(topologyMutex);
+        int index = (int)(find(faultModels.begin(), faultModels.end(), f) - faultModels.begin());
+        if (index == (int)faultModels.size()) faultModels.push_back(f);
+        return index;
+    }
+    // Заменить модель сбоев уже созданной связи from -> to (и обратной при bidirectional); 
+    // LinkFault по умолчанию снимает модель. Поиск связи упорядочивает список связей, поэтому 
+    // для многих связей дешевле передать номер модели при их создании (createLink и др.).
+    void setLinkFault(int from, int to, LinkFault const &f, bool bidirectional = true) {
+        int index = faultModel(f);
+        lock_guard<mutex> ar(topologyMutex);
+        compactLinks();
+        for (int k = 0; k < (bidirectional ? 2 : 1); k++) {
+            Link key{k ? to : from, k ? from : to, 0, 0};
+            auto it = lower_bound(links.begin(), links.end(), key, [](Link const &a, Link const &b) {
+                return a.from < b.from || (a.from == b.from && a.to < b.to);
+            });
+            if (it == links.end() || it->from != key.from || it->to != key.to || it->fault == index) continue;
+            it->fault = index;
+            topologyDirty = true;
+        }
     }
     int getLink(int p1, int p2) {
         if (p1 < 0 || p1 == p2) return 0;
-        if (networkMap.find(p1) != networkMap.end() &&
-          networkMap[p1].find(p2) != networkMap[p1].end())
-            return networkMap[p1][p2];
-        return -1;
+        TopologyReader reader(*this);
+        Topology const &t = topology();
+        int e = t.edge(p1, p2);
+        return e < 0 ? -1 : t.latency[e];
+    }
+    // Текущее замороженное представление топологии. Ссылка действительна, пока жив TopologyReader потока,
+    // а без него - до следующего изменения связей.
+    Topology const &topology() {
+        if (topologyDirty.load(memory_order_acquire)) rebuildTopology();
+        return *currentTopology.load();
+    }
+    // Чтение топологии потоком (эпохи): пока объект жив, представления, которые поток мог прочитать, 
+    // не удаляются. Перестройка снимает прежнее представление с номером новой эпохи, и оно удаляется, 
+    // когда не остаётся читателей, вошедших раньше. Обработчики (Process::deliver) и отправка сообщений
+    // работают под ним, поэтому выданные обработчику Neighbors действительны до его завершения.
+private:
+    struct ReaderSlot;
+public:
+    class TopologyReader {
+    public:
+        explicit TopologyReader(NetworkLayer &nl) : slot(nl.readerSlot()) {
+            if (slot->depth++ == 0) slot->epoch.store(nl.topologyEpoch.load());
+        }
+        ~TopologyReader() {
+            if (--slot->depth == 0) slot->epoch.store(0, memory_order_release);
+        }
+        TopologyReader(TopologyReader const &) = delete;
+        TopologyReader &operator=(TopologyReader const &) = delete;
+    private:
+        ReaderSlot *slot;
+    };
+    void rebuildTopology() {
+        lock_guard<mutex> ar(topologyMutex);
+        if (!topologyDirty.load(memory_order_relaxed)) return;
+        Topology *t = new Topology;
+        compactLinks();
+        int n = networkSize;
+        for (auto const &l: links) n = max(n, max(l.from, l.to) + 1);
+        t->offsets.assign(n + 1, 0);
+        for (auto const &l: links) t->offsets[l.from + 1]++;
+        for (int i = 0; i < n; i++) t->offsets[i + 1] += t->offsets[i];
+        t->targets.reserve(links.size());
+        t->latency.reserve(links.size());
+        t->fault.reserve(links.size());
+        t->faults = faultModels;
+        for (auto const &l: links) {
+            t->targets.push_back(l.to);
+            t->latency.push_back(l.latency);
+            t->fault.push_back(l.fault);
+        }
+        t->burst.assign(t->targets.size(), 0);
+#if DSSIMUL_STATS
+        // Счётчики связей переносятся из прежнего представления
+        t->linkStats.resize(t->targets.size());
+        Topology const *old = ownedTopology.get();
+        for (int from = 0; old != nullptr && from < min(old->size(), t->size()); from++) {
+            Neighbors n = old->neighbors(from);
+            for (const int *to = n.begin(); to != n.end(); ++to) {
+                int e = t->edge(from, *to);
+                if (e >= 0) t->linkStats[e] = old->linkStats[n.edge(to)];
+            }
+        }
+#endif
+        // Прежнее представление ещё могут читать другие потоки: оно удаляется позже (reclaimTopologies)
+        currentTopology.store(t);
+        if (ownedTopology != nullptr) retiredTopologies.emplace_back(topologyEpoch.fetch_add(1) + 1, move(ownedTopology));
+        ownedTopology.reset(t);
+        topologyDirty.store(false, memory_order_release);
+        reclaimTopologies();
     }
     int send(int fromProcess, int toProcess, Message const &msg) {
-        if (toProcess >= 0) return send(fromProcess, toProcess, msg.body);
+        if (toProcess >= 0) return send(fromProcess, toProcess, msg.body, msg.type);
         for (size_t i = 0; i < queueMap.size(); i++) 
-            if (queueMap[i] != nullptr) send(fromProcess, (int)i, msg.body);
+            if (queueMap[i] != nullptr) send(fromProcess, (int)i, msg.body, msg.type);
         return ErrorCode::OK;
     }
     int send(int fromProcess, int toProcess, bytevector const &msg) {
-        if (toProcess >= networkSize) return ErrorCode::SizeTooBig;
-        Message m(fromProcess, toProcess, msg);
-        if (errorRate > 0 && distrib(rng) < errorRate) return ErrorCode::TimeOut;
-        if (queueMap[toProcess] == nullptr) return ErrorCode::ItemNotFound;
-        int p = getLink(fromProcess, toProcess);
-        if (p < 0) return ErrorCode::ItemNotFound;
-        m.sendTime = tick;
-        m.deliveryTime = tick + p;
-        queueMap[toProcess]->enqueue(m);
-        return ErrorCode::OK;
+        return send(fromProcess, toProcess, Payload(msg));
+    }
+    int send(int fromProcess, int toProcess, Payload const &msg) {
+        return send(fromProcess, toProcess, msg, MessageTypes::of(msg.data(), msg.size()));
+    }
+    // Тело сообщения не кодируется заново: рассылка всем процессам копирует короткое тело или ссылку на длинное
+    int send(int fromProcess, int toProcess, Payload const &msg, int type) {
+        // При воспроизведении сообщения извне берутся из трассы
+        if (mode == Replay && fromProcess < 0) return ErrorCode::OK;
+        Message m(fromProcess, toProcess, msg, type);
+        m.origin = fromProcess;
+        if (toProcess >= networkSize) {
+            m.seq = -1;
+            drop(m, DropSizeTooBig);
+            return ErrorCode::SizeTooBig;
+        }
+        m.seq = nextSeq(fromProcess);
+        int rc = transmit(m);
+        countSent(fromProcess, rc == ErrorCode::TimeOut);
+        return rc;
     }
     int registerProcess(int node, Process *dp);
+    // Контекст типа type процесса dp; создаётся, если его ещё нет (см. Process::ctx)
+    void *context(Process *dp, ContextType const &type);
+    // Все контексты типа: nullptr, если ни одного не создано. Обходить только при остановленной модели.
+    ContextArray const *contexts(ContextType const &type) {
+        lock_guard<mutex> lock(contextsMutex);
+        return type.id < (int)contextArrays.size() ? contextArrays[type.id].get() : nullptr;
+    }
+    // Виртуальное время и синхронный режим: обработать все события с deliveryTime <= limit
+    // и перевести часы на limit. Возвращает число обработанных сообщений.
+    // При stopWhenIdle модель останавливается раньше, как только не остаётся ни сообщений, ни таймеров процессов.
+    int64 runUntil(int64 limit, bool stopWhenIdle = false);
+    // Модель затихла: нет сообщений в пути, таймеров процессов и исполняющихся обработчиков.
+    // Периодическая рассылка *TIME (launch timer) не учитывается.
+    bool isQuiescent();
+    // Режим RealTime: ждать затихания модели, но не дольше такта limit. Возвращает isQuiescent().
+    bool waitQuiescent(int64 limit);
+    // launch timer: периодическая рассылка *TIME всем процессам
+    void launchTimer(int period);
+    // Текущее время для обработчика: в режиме Parallel у каждой части свои часы, 
+    // и NetworkLayer::tick показывает лишь начало текущего окна
+    int64 now() const {
+        Partition *p = currentPartition();
+        return p != nullptr ? p->clock : tick.load();
+    }
+    // Таймеры процессов: сообщение msg будет доставлено процессу node через delay тактов
+    // (в синхронном режиме - не раньше следующего раунда). Возвращает номер таймера для cancelTimer.
+    int64 setTimer(int node, int64 delay, Message const &msg);
+    // Отменить таймер. Возвращает false, если таймер уже сработал или не найден.
+    bool cancelTimer(int node, int64 id);
+    // Периодическая рассылка *TIME всем процессам (launch timer) в режимах Virtual, Parallel и Synchronous
+    void addTicker(int period) {
+        if (period > 0) tickers.push_back(Ticker{period, tick + (mode == Synchronous ? 1 : 0), 0});
+    }
     vector<MessageQueue *>  queueMap;
+    vector<Process *>       processMap;
+    WorkerPool              pool;
     double errorRate = 0.;
-    mt19937 rng;
-    uniform_real_distribution<> distrib = uniform_real_distribution<>(0.0, 1.0);
-    volatile long long tick = 0;
-    void addLinksToAll(int from, bool bidirectional = true, int latency = 0) {
-        for (int i = 0; i < networkSize; i++) 
-            if (from != i) networkMap[from][i] = latency;
-        if (bidirectional) {
-            for (int i = 0; i < networkSize; i++) 
-                if (from != i) networkMap[i][from] = latency;
+    // Зерно потерь (seed) и номер потока случайных чисел (stream). Поток 0 использует зерно как есть,
+    // поэтому реплика 0 пакетного прогона совпадает с обычным запуском с тем же seed, а реплику i 
+    // можно повторить отдельно директивой "seed" с её итоговым зерном (lossSeed).
+    void setSeed(uint64 seed) { baseSeed = seed; lossSeed = mixSeed(seed, seedStream); }
+    void setStream(uint64 stream) { seedStream = stream; lossSeed = mixSeed(baseSeed, stream); }
+    static uint64 mixSeed(uint64 seed, uint64 stream) {
+        if (stream == 0) return seed;
+        uint64 x = seed + stream * 0x9E3779B97F4A7C15ULL;
+        x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ULL;
+        x ^= x >> 27; x *= 0x94D049BB133111EBULL;
+        return x ^ (x >> 31);
+    }
+    // Число отправленных (включая потерянные) и потерянных сообщений
+    int64 sentMessages() const;
+    int64 lostMessages() const;
+    // Снимок счётчиков процессов и связей. Можно вызывать и во время работы модели: 
+    // счётчики читаются без блокировок, но снимок тогда не мгновенный.
+    StatsSnapshot stats();
+    // Снимок модели (см. World::checkpoint) делается и читается при остановленной модели в режимах Virtual, 
+    // Parallel и Synchronous без шардов. Сеть пишет заголовок (режим, часы, зёрна, errorRate), топологию 
+    // с моделями сбоев и состоянием пакетных потерь, периодические таймеры (saveNetwork), а также сообщения 
+    // в пути и таймеры процессов (saveEvents). Счётчики статистики в снимок не входят.
+    bool canCheckpoint() const {
+        return (mode == Virtual || mode == Parallel || mode == Synchronous) && shardCount <= 1 && tracer == nullptr;
+    }
+    void saveHeader(CheckpointHeader &h) const;
+    void loadHeader(CheckpointHeader const &h, bool replica);
+    void saveNetwork(CheckpointWriter &w);
+    bool loadNetwork(CheckpointReader &r);
+    void saveEvents(CheckpointWriter &w);
+    bool loadEvents(CheckpointReader &r);
+    // Не выводить сообщения процессов (Process::log), например, в пакетном прогоне
+    bool quiet = false;
+    // Начать запись двоичной трассы (см. TraceRecord) в файл name; прежняя трасса закрывается
+    bool startTrace(string const &name) {
+        stopTrace();
+        unique_ptr<TraceWriter> t(new TraceWriter);
+        if (!t->open(name)) return false;
+        traceStart = tick;
+        tracer = move(t);
+        return true;
+    }
+    // Закрыть трассу. Вызывается, когда модель не работает (обработчики не исполняются).
+    bool stopTrace() {
+        if (!tracer) return true;
+        TraceHeader h;
+        h.seed = lossSeed;
+        h.mode = mode;
+        h.processes = (int)processMap.size();
+        h.startTick = traceStart;
+        h.endTick = tick;
+        bool ok = tracer->finish(h);
+        tracer.reset();
+        return ok;
+    }
+    // Перейти в режим Replay: воспроизводить трассу name. Процессы и связи создаются как в записанном
+    // прогоне (тем же файлом конфигурации), сообщения извне и периодические *TIME берутся из трассы.
+    bool startReplay(string const &name) {
+        TraceFile f;
+        unique_ptr<ReplayLog> r(new ReplayLog);
+        if (!f.open(name) || !r->load(f)) return false;
+        lock_guard<recursive_mutex> ar(globalTimerMutex);
+        mode = Replay;
+        tick = r->startTick;
+        replay = move(r);
+        return true;
+    }
+    // Открытая трасса или nullptr; без трассы запись стоит одной проверки указателя
+    unique_ptr<TraceWriter> tracer;
+    void trace(int kind, Message const &m, int flags = 0, int64 value = 0, Payload const *body = nullptr) {
+        TraceRecord r;
+        r.kind = (byte)kind;
+        r.flags = (byte)flags;
+        r.type = m.type;
+        r.from = m.from;
+        r.to = m.to;
+        r.origin = m.origin;
+        r.size = (int32)m.body.size();
+        r.seq = m.seq;
+        r.time = now();
+        r.value = value;
+        tracer->write(r, body);
+    }
+    // Случайное число из [0, 1) для решения о потере сообщения (origin, seq).
+    // Не имеет общего состояния, поэтому не требует синхронизации при параллельной отправке
+    // и даёт одинаковый результат при любом порядке исполнения обработчиков.
+    // Для разных решений об одном сообщении (потеря, дублирование, задержка...) служит номер salt.
+    double lossDraw(int origin, int64 seq, int salt = 0) const {
+        uint64 x = lossSeed ^ ((uint64)(uint32)origin * 0x9E3779B97F4A7C15ULL) ^ ((uint64)seq * 0xC2B2AE3D27D4EB4FULL) ^
+            ((uint64)salt * 0xD6E8FEB86659FD93ULL);
+        x ^= x >> 30; x *= 0xBF58476D1CE4E5B9ULL;
+        x ^= x >> 27; x *= 0x94D049BB133111EBULL;
+        x ^= x >> 31;
+        return (double)(x >> 11) * (1.0 / 9007199254740992.0);
+    }
+    static constexpr uint64 DefaultSeed = 0x243F6A8885A308D3ULL;
+    uint64 lossSeed = DefaultSeed, baseSeed = DefaultSeed, seedStream = 0;
+    atomic<int64> tick{0};
+    void addLinksToAll(int from, bool bidirectional = true, int latency = 0, int fault = 0) {
+        if (latency < 0) return;
+        lock_guard<mutex> ar(topologyMutex);
+        for (int i = 0; i < networkSize; i++) {
+            if (from == i) continue;
+            links.push_back(Link{from, i, latency, fault});
+            if (bidirectional) links.push_back(Link{i, from, latency, fault});
         }
+        topologyDirty = true;
     }
-    void addLinksFromAll(int to, bool bidirectional = true, int latency = 0) {
-        for (int i = 0; i < networkSize; i++) 
-            if (i != to) networkMap[i][to] = latency;
-        if (bidirectional) {
-            for (int i = 0; i < networkSize; i++) 
-                if (to != i) networkMap[to][i] = latency;
+    void addLinksFromAll(int to, bool bidirectional = true, int latency = 0, int fault = 0) {
+        if (latency < 0) return;
+        lock_guard<mutex> ar(topologyMutex);
+        for (int i = 0; i < networkSize; i++) {
+            if (to == i) continue;
+            links.push_back(Link{i, to, latency, fault});
+            if (bidirectional) links.push_back(Link{to, i, latency, fault});
         }
+        topologyDirty = true;
     }
-    void addLinksAllToAll(bool bidirectional = true, int latency = 0) {
+    // Полный граф: связи добавляются сразу упорядоченными, по одной на каждую пару в каждую сторону
+    void addLinksAllToAll(int latency = 0, int fault = 0) {
+        if (latency < 0) return;
+        lock_guard<mutex> ar(topologyMutex);
+        links.reserve(links.size() + (size_t)networkSize * max(networkSize - 1, 0));
         for (int i = 0; i < networkSize; i++) 
-            addLinksFromAll(i, bidirectional, latency);
+            for (int j = 0; j < networkSize; j++) 
+                if (i != j) links.push_back(Link{i, j, latency, fault});
+        topologyDirty = true;
     }
-    set<int> neibs(int from) {
-        set<int> ret;
-        for (const auto n : networkMap[from]) ret.insert(n.first);
-        return ret;
+    Neighbors neibs(int from) {
+        return topology().neighbors(from);
     }
 //    void clear() {
-//        networkMap.clear();
+//        links.clear();
 //    }
     bool stopFlag = false;
+    // Режим RealTime: сообщение обработано (вызывается после deliver)
+    void delivered() {
+        if (--inFlight == 0) {
+            lock_guard<mutex> ar(quiescentMutex);
+            quiescentCv.notify_all();
+        }
+    }
 private:
-    int networkSize;
-    using mii = map<int, int>;
-    map< int, mii> networkMap;
+    int64 nextSeq(int fromProcess);
+    // Провести сообщение через сеть: потери, задержка и сбои связи; поставить в очередь получателя
+    int transmit(Message &m);
+    void post(Message const &m) {
+        if (transport != nullptr && (mode == Virtual || mode == Parallel) && partitionOf(m.to) != shard) {
+            // Сообщение извне (директива send) разбирает каждый шард, оставляет его шард получателя
+            if (currentPartition() != nullptr) toShard(m);
+            return;
+        }
+        DSS_STAT(countEnqueued(m.to));
+        if (mode == Virtual || mode == Parallel) postEvent(m);
+        else if (mode == Synchronous) postToRound(m);
+        else if (mode == Replay) replay->post(m);
+        else enqueue(m);
+    }
+    // Сообщение отброшено при отправке
+    void drop(Message const &m, DropReason reason) {
+        DSS_STAT(countDrop(m.origin, reason));
+        if (tracer) trace(TraceDrop, m, reason);
+    }
+    int replayTransmit(Message &m);
+    int64 runReplay(int64 limit, bool stopWhenIdle);
+    unique_ptr<ReplayLog> replay;
+    int64 traceStart = 0;
+    enum DrawSalt { SaltLoss, SaltLinkLoss, SaltBurst, SaltDup, SaltJitter, SaltDupJitter };
+    // Режим RealTime: поставить процесс в очередь пула, когда наступит такт when.
+    // Процессы без сообщений к доставке не занимают ни потоков, ни процессорного времени.
+    void wakeAt(int node, int64 when);
+    void wakeDue();
+    void fireTimers();
+    static uint64 timerKey(int node, int64 id) { return ((uint64)(uint32)node << 40) ^ (uint64)id; }
+    // Таймеры режима RealTime; колесо продвигает глобальный таймер
+    TimerWheel timers;
+    mutex timersMutex;
+    // Режим RealTime: сообщения, поставленные в почтовые ящики, но ещё не обработанные
+    atomic<int64> inFlight{0};
+    mutex quiescentMutex;
+    condition_variable quiescentCv;
+    vector<thread> tickerThreads;
+    void enqueue(Message const &m) {
+        inFlight++;
+        queueMap[m.to]->enqueue(m);
+        wakeAt(m.to, m.deliveryTime);
+    }
+    using WakeEntry = pair<int64, int>;
+    priority_queue<WakeEntry, vector<WakeEntry>, greater<WakeEntry> > wakeQueue;
+    mutex wakeMutex;
+    struct Ticker {
+        int64 period, next;
+        int counter;
+    };
+    vector<Ticker> tickers;
+    // Режимы Virtual и Parallel. Часть (Partition) - отрезок подряд идущих номеров процессов со своим 
+    // календарём событий и копией периодических таймеров. Режим Virtual - это одна часть без окон.
+    // Сообщения в другую часть складываются в out[чётность окна][часть-получатель] и переносятся
+    // в календарь получателя в начале следующего окна: их время доставки не раньше конца текущего окна.
+    struct Partition {
+        EventCalendar calendar;
+        TimerWheel timers;
+        vector<Ticker> tickers;
+        vector<vector<Message> > out[2];
+        int first = 0, last = 0, parity = 0;
+        int64 clock = 0, handled = 0;
+        int64 nextTime() const;
+    };
+    int64 runPartitions(int64 limit, bool stopWhenIdle);
+    void preparePartitions(int count = 0);
+    void runPartition(Partition &p, int64 windowLast, bool idleStop);
+    bool isIdle(int parity) const;
+    void postEvent(Message const &m);
+    int partitionOf(int node) const {
+        // Границы шардов неизменны: процессы, созданные после их запуска, достаются последнему
+        int n = transport != nullptr ? partitionNodes : (int)processMap.size();
+        return (n == 0 || node < 0) ? 0 : (int)min((int64)node * (int64)partitions.size() / n, (int64)partitions.size() - 1);
+    }
+    int64 computeLookahead();
+    static Partition *&currentPartition() { static thread_local Partition *p = nullptr; return p; }
+    vector<Partition> partitions;
+    int partitionNodes = 0;
+    // Шарды: часть partitions[shard] исполняет этот процесс ОС, остальные части пусты
+    bool startShards();
+    int64 runShard(int64 limit, bool stopWhenIdle);
+    void toShard(Message const &m);
+    void receiveShard();
+    unique_ptr<ShardTransport> transport;
+    int shardCount = 1, shard = 0;
+    int64 shardLookahead = 0, shardRound = 0;
+    bool shardsIdle = false;
+    // Синхронный режим. Процессы разбиты на roundChunks отрезков подряд идущих номеров; 
+    // отрезок - единица параллельной работы в раунде. Исходящие сообщения раунда складываются 
+    // в буферы roundNext[источник * roundChunks + получатель], которые читает только задача отрезка-получателя,
+    // поэтому раунд не требует блокировок. После барьера буферы roundNext и roundPrev меняются местами.
+    // Строка источника с номером roundChunks - внешние сообщения, отправленные между раундами.
+    int64 runRounds(int64 limit, bool stopWhenIdle);
+    void prepareRounds();
+    void runChunk(int chunk, vector<Message> const &timeMessages);
+    void postToRound(Message const &m);
+    int chunkOf(int node) const { return (int)((int64)node * roundChunks / roundNodes); }
+    static vector<Message> *&roundOutbox() { static thread_local vector<Message> *row = nullptr; return row; }
+    int roundChunks = 0, roundNodes = 0;
+    vector<vector<Message> > roundPrev, roundNext, roundInbox;
+    vector<TimerWheel> roundTimers;
+    atomic<int64> roundHandled{0};
+    atomic<int64> externalSeq{0};
+    atomic<int64> externalSent{0}, externalLost{0};
+    void countSent(int fromProcess, bool lost);
+#if DSSIMUL_STATS
+    atomic<int64> externalDrops[DropReasons] = {};
+    void countDrop(int fromProcess, DropReason reason);
+    void countEnqueued(int node);
+#endif
+    int networkSize = 0;
+    // fault - номер модели сбоев в faultModels (0 - без сбоев)
+    struct Link {
+        int from, to, latency, fault;
+    };
+    vector<Link> links;
+    // Упорядочить links по (from, to) и оставить из повторов последнюю связь. Сортировка подсчётом по from 
+    // сохраняет порядок добавления, поэтому строки процессов (обычно короткие) досортировываются устойчиво.
+    void compactLinks() {
+        int n = 0;
+        bool sorted = true;
+        for (size_t i = 0; i < links.size(); i++) {
+            n = max(n, links[i].from + 1);
+            if (i > 0 && (links[i - 1].from > links[i].from || 
+                (links[i - 1].from == links[i].from && links[i - 1].to >= links[i].to))) sorted = false;
+        }
+        if (sorted) return;
+        vector<size_t> start(n + 1, 0);
+        for (auto const &l: links) start[l.from + 1]++;
+        for (int i = 0; i < n; i++) start[i + 1] += start[i];
+        vector<Link> byFrom(links.size());
+        vector<size_t> pos(start.begin(), start.end() - 1);
+        for (auto const &l: links) byFrom[pos[l.from]++] = l;
+        links.clear();
+        for (int i = 0; i < n; i++) {
+            auto first = byFrom.begin() + start[i], last = byFrom.begin() + start[i + 1];
+            stable_sort(first, last, [](Link const &a, Link const &b) { return a.to < b.to; });
+            for (auto it = first; it != last; ++it) {
+                if (it + 1 != last && (it + 1)->to == it->to) continue;
+                links.push_back(*it);
+            }
+        }
+        links.shrink_to_fit();
+    }
+    // Модели сбоев связей; связь хранит номер модели (Link::fault)
+    vector<LinkFault> faultModels = vector<LinkFault>(1);
+    mutex topologyMutex;
+    // Контексты рабочих функций по номеру типа (ContextType::id)
+    vector<unique_ptr<ContextArray> > contextArrays;
+    mutex contextsMutex;
+    atomic<bool> topologyDirty{true};
+    atomic<Topology *> currentTopology{nullptr};
+    unique_ptr<Topology> ownedTopology;
+    // Снятые представления с номером эпохи снятия (под topologyMutex)
+    vector<pair<uint64, unique_ptr<Topology> > > retiredTopologies;
+    // Эпоха топологии и слоты читателей по потокам (см. TopologyReader): эпоха входа в чтение или 0 вне его
+    struct ReaderSlot {
+        atomic<uint64> epoch{0};
+        int depth = 0;          // вложенность TopologyReader; меняет только поток-владелец
+    };
+    atomic<uint64> topologyEpoch{1};
+    vector<unique_ptr<ReaderSlot> > readerSlots;
+    unordered_map<thread::id, ReaderSlot *> readerByThread;
+    mutex readersMutex;
+    const uint64 readerId = ++lastReaderId();
+    // Номер сети для кэша потока: адрес удалённой сети может достаться новой
+    static atomic<uint64> &lastReaderId() { static atomic<uint64> n{0}; return n; }
+    ReaderSlot *readerSlot() {
+        struct Cached { uint64 owner = 0; ReaderSlot *slot = nullptr; };
+        static thread_local Cached cached;
+        if (cached.owner == readerId) return cached.slot;
+        lock_guard<mutex> ar(readersMutex);
+        ReaderSlot *&slot = readerByThread[this_thread::get_id()];
+        if (slot == nullptr) {
+            readerSlots.emplace_back(new ReaderSlot);
+            slot = readerSlots.back().get();
+        }
+        cached.owner = readerId;
+        cached.slot = slot;
+        return slot;
+    }
+    // Удалить снятые представления, которые не может читать ни один поток. Представление, снятое 
+    // в эпоху E, мог прочитать только читатель, вошедший раньше (с эпохой меньше E). Под topologyMutex.
+    void reclaimTopologies() {
+        if (retiredTopologies.empty()) return;
+        uint64 oldest = numeric_limits<uint64>::max();
+        {
+            lock_guard<mutex> ar(readersMutex);
+            for (auto const &r: readerSlots) {
+                uint64 e = r->epoch.load();
+                if (e != 0) oldest = min(oldest, e);
+            }
+        }
+        size_t kept = 0;
+        for (auto &r: retiredTopologies) 
+            if (r.first > oldest) retiredTopologies[kept++] = move(r);
+        retiredTopologies.resize(kept);
+    }
+    recursive_mutex globalTimerMutex;
+    mutex timerSleepMutex;
+    // Шард, порождённый fork(), получает новое условие (см. startShards), поэтому оно хранится по указателю
+    unique_ptr<condition_variable> timerSleep{new condition_variable};
     thread globalTimer = thread(globalTimerExecutor, this);
     static void globalTimerExecutor(NetworkLayer *nl) {
-        auto start = std::chrono::system_clock::now();
+        auto start = std::chrono::steady_clock::now();
+        unique_lock<mutex> sleeping(nl->timerSleepMutex);
         while (!nl->stopFlag) {
-            auto cl = std::chrono::system_clock::now() - start;
-            nl->tick = chrono::duration_cast<chrono::milliseconds>(cl).count() / 1000;
-            this_thread::sleep_for(chrono::milliseconds(100));
+            auto cl = std::chrono::steady_clock::now() - start;
+            int64 now = chrono::duration_cast<chrono::milliseconds>(cl).count() / 1000;
+            {
+                lock_guard<recursive_mutex> ar(nl->globalTimerMutex);
+                if (nl->mode == RealTime) nl->tick = now;
+            }
+            sleeping.unlock();
+            nl->fireTimers();
+            nl->wakeDue();
+            sleeping.lock();
+            // Спим ровно до начала следующего такта: процессы будятся в момент наступления deliveryTime
+            nl->timerSleep->wait_until(sleeping, start + chrono::seconds(now + 1), [nl] { return nl->stopFlag; });
         }
     }
-    recursive_mutex globalTimerMutex;
 };
 
-using workFunction = int (*)(Process *context, Message m);
+// Сообщение передаётся по ссылке; перед вызовом каждой рабочей функции позиция чтения (ptr) сбрасывается
+using workFunction = int (*)(Process *context, Message &m);
+
+// Контексты рабочих функций
+#include "contextes.h"
 
 class Process {
 public:
-    Process(int _node) : node(_node), stopFlag(false) {
-        workerThread = thread(workerThreadExecutor, this);
-    }
-    ~Process() {
-        stopFlag = true; workerThread.join();
+    Process(int _node) : node(_node) {
     }
     MessageQueue workerMessagesQueue;
-    set<int> neibs() {
+    // Передать сообщение рабочим функциям процесса. Возвращает true, если одна из них его обработала
+    // Сообщение сразу получает рабочая функция его семейства (по таблице dispatch); 
+    // служебные сообщения ('*'), сообщения без типа или без своей функции, а также отвергнутые ею,
+    // по-прежнему предлагаются всем рабочим функциям по очереди.
+    bool deliver(Message &m) {
+        NetworkLayer::TopologyReader reader(*networkLayer);
+        int64 index = deliveries++;
+        bool tracing = networkLayer->tracer != nullptr;
+        // Тело в трассу пишется только у сообщений извне: остальные при воспроизведении создают обработчики
+        if (tracing) networkLayer->trace(TraceDeliver, m, m.origin < 0, index, m.origin < 0 ? &m.body : nullptr);
+#if DSSIMUL_STATS
+        stats.lateness.add(networkLayer->now() - m.deliveryTime);
+        // Очередь процесса растёт только между доставками, поэтому её наибольшая длина видна перед доставкой
+        // во всех режимах: в календаре событий очереди процесса как таковой нет
+        stats.maxDepth.raise(stats.enqueued.load(memory_order_relaxed) - stats.delivered);
+        // Чтение часов дороже короткого обработчика, поэтому время измеряется у каждого HandlerSample-го
+        // события потока: счётчик процесса не годится, при рассылках процесс получает лишь несколько сообщений.
+        // Первое событие процесса измеряется всегда, чтобы гистограмма не пустовала в коротких прогонах.
+        static thread_local unsigned sample = 0;
+        bool timed = tracing || ++sample % ProcessStats::HandlerSample == 0 || stats.delivered == 0;
+#else
+        bool timed = tracing;
+#endif
+        bool handled;
+        int64 ns = 0;
+        if (timed) {
+            auto start = chrono::steady_clock::now();
+            handled = handle(m);
+            ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+        } else handled = handle(m);
+#if DSSIMUL_STATS
+        if (timed) stats.handlerNs.add(ns);
+        stats.delivered++;
+        if (!handled) stats.unhandled++;
+#endif
+        if (tracing) networkLayer->trace(TraceHandler, m, handled, ns);
+        return handled;
+    }
+    bool handle(Message &m) {
+        int fam = MessageTypes::family(m.type);
+        int owner = (fam >= 0 && fam < (int)dispatch.size()) ? dispatch[fam] : -1;
+        if (owner >= 0) {
+            m.ptr = 0;
+            if (workers[owner](this, m)) return true;
+        }
+        for (int i = 0; i < (int)workers.size(); i++) {
+            if (i == owner) continue;
+            m.ptr = 0;
+            if (workers[i](this, m)) return true;
+        }
+        return false;
+    }
+    // Таймер процесса: через delay тактов процессу придёт сообщение m (tag) от самого себя.
+    // Возвращает номер таймера; cancelTimer отменяет таймер, если он ещё не сработал.
+    int64 setTimer(int64 delay, Message const &m) { return networkLayer->setTimer(node, delay, m); }
+    int64 setTimer(int64 delay, const char *tag) { return setTimer(delay, Message(tag)); }
+    bool cancelTimer(int64 id) { return networkLayer->cancelTimer(node, id); }
+    // Счётчик отправленных процессом сообщений и таймеров (см. Message::seq)
+    int64 sendSeq = 0;
+    // Счётчик доставленных процессу сообщений: порядок доставки в трассе
+    int64 deliveries = 0;
+    // Отправленные процессом сообщения (без таймеров) и потерянные из них
+    StatCounter<int64> sentCount, lostCount;
+#if DSSIMUL_STATS
+    ProcessStats stats;
+#endif
+    // Вывод рабочей функции (как printf); подавляется флагом NetworkLayer::quiet
+    void log(const char *format, ...) {
+        if (networkLayer->quiet) return;
+        va_list args;
+        va_start(args, format);
+        vprintf(format, args);
+        va_end(args);
+    }
+    Neighbors neibs() {
         return networkLayer->neibs(node);
     }
     // Распределённый процесс может исполнять различные рабочие функции в зависимости от пришедшего сообщения
     // Каждая рабочая функция поддерживает свой контекст исполнения, для разных функций он может быть разным 
-    void registerWorkFunction(string const &/*prefix*/, workFunction wf) {
+    void registerWorkFunction(string const &prefix, workFunction wf) {
+        int fam = MessageTypes::registerFamily(prefix);
+        if (fam >= (int)dispatch.size()) dispatch.resize(fam + 1, -1);
+        if (dispatch[fam] < 0) dispatch[fam] = (int)workers.size();
         workers.push_back(wf); 
     }
-    // Исполнительный поток пробует вызвать зарегистрированные рабочие функции. 
+    // Имена рабочих функций в порядке регистрации (по таблице dispatch); пустое - у функции без своего семейства
+    vector<string> workFunctionNames() const {
+        vector<string> names(workers.size());
+        for (int fam = 0; fam < (int)dispatch.size(); fam++)
+            if (dispatch[fam] >= 0) names[dispatch[fam]] = MessageTypes::name(fam);
+        return names;
+    }
+    // Поток пула пробует вызвать зарегистрированные рабочие функции. 
     // Если рабочая функция распознала сообщение, как предназначенное ей, она возвращает true.
     // Возможна ситуация, когда ни одна из рабочих функций не обработает сообщение, тогда оно пропадает.
     NetworkLayer *networkLayer;
@@ -268,25 +2563,46 @@ public:
             if (prefix[i] != message[i]) return false;
         return message[prefix.size()] == '_';
     }
-// Контексты рабочих функций
-#include "contextes.h"
+    // Контекст рабочей функции типа T (см. contextes.h). Создаётся при назначении процессу рабочей функции,
+    // зарегистрированной с этим типом (World::registerWorkFunction<T>), иначе - при первом обращении.
+    template<class T> T &ctx() {
+        ContextType const &type = ContextType::of<T>();
+        if (type.id < (int)contexts.size() && contexts[type.id] != nullptr) return *(T *)contexts[type.id];
+        return *(T *)networkLayer->context(this, type);
+    }
+    // Контекст типа T без создания: nullptr, если у процесса его нет
+    template<class T> T *findCtx() const {
+        int id = ContextType::of<T>().id;
+        return id < (int)contexts.size() ? (T *)contexts[id] : nullptr;
+    }
+    // Контексты процесса по номеру типа; сами они лежат в ContextArray сетевого уровня
+    vector<void *> contexts;
+    // Сообщить процессу, что в его очереди могло появиться сообщение к доставке.
+    // Процесс ставится в очередь пула не более одного раза; обработчики одного процесса 
+    // никогда не исполняются одновременно в разных потоках.
+    void wake() {
+        notified = true;
+        if (!scheduled.exchange(true)) 
+            networkLayer->pool.submit([this] { runDue(); });
+    }
 private:
-    thread  workerThread;
-    static void workerThreadExecutor(Process *dp) {
-        while (!dp->stopFlag) {
-            // Поток обнаруживает появление сообщений в очереди принятых сообщений 
-            // и что-то делает в зависимости от самого сообщения
-            if (dp->workerMessagesQueue.size() > 0 && dp->networkLayer->tick >= dp->workerMessagesQueue.peek().deliveryTime) {
-                // Пришло новое сообщение в рабочую очередь
-                Message m = dp->workerMessagesQueue.dequeue();
-                for (auto worker: dp->workers) 
-                    if (worker(dp, m)) break;
+    // Исполняется потоком пула: доставить все сообщения, время которых наступило
+    void runDue() {
+        do {
+            notified = false;
+            while (workerMessagesQueue.hasDue(networkLayer->tick)) {
+                Message m = workerMessagesQueue.dequeue();
+                deliver(m);
+                networkLayer->delivered();
             }
-            this_thread::sleep_for(chrono::milliseconds(1));
-        }
+            scheduled = false;
+            // Пробуждение, пришедшее во время обработки, не должно потеряться
+        } while (notified && !scheduled.exchange(true));
     }
-    bool        stopFlag;
+    atomic<bool> scheduled{false}, notified{false};
     vector<workFunction> workers;
+    // Семейство типа сообщения -> номер рабочей функции в workers (или -1)
+    vector<int> dispatch;
 };
 
 inline int NetworkLayer::registerProcess(int node, Process *dp) {
@@ -294,21 +2610,971 @@ inline int NetworkLayer::registerProcess(int node, Process *dp) {
     if (node >= (int)queueMap.size()) queueMap.resize(node+1);
     if (queueMap[node] != nullptr) return ErrorCode::DuplicateItems;
     queueMap[node] = &dp->workerMessagesQueue;
+    processMap.resize(queueMap.size());
+    processMap[node] = dp;
     networkSize = (int)queueMap.size();
+    topologyDirty = true;
+    return ErrorCode::OK;
+}
+
+// Контекст создаёт поток процесса или поток настройки модели; массив типа общий, поэтому под замком.
+// Вектор contexts процесса меняет только он сам, а читают чужие контексты при остановленной модели.
+inline void *NetworkLayer::context(Process *dp, ContextType const &type) {
+    if (type.id < (int)dp->contexts.size() && dp->contexts[type.id] != nullptr) return dp->contexts[type.id];
+    lock_guard<mutex> lock(contextsMutex);
+    if (type.id >= (int)contextArrays.size()) contextArrays.resize(type.id + 1);
+    if (contextArrays[type.id] == nullptr) contextArrays[type.id].reset(new ContextArray(type));
+    if (type.id >= (int)dp->contexts.size()) dp->contexts.resize(type.id + 1, nullptr);
+    return dp->contexts[type.id] = contextArrays[type.id]->add(dp->node);
+}
+
+inline void NetworkLayer::wakeAt(int node, int64 when) {
+    {
+        // tick читается под wakeMutex: глобальный таймер меняет tick до того, как разбирает wakeQueue,
+        // поэтому запись не может попасть в очередь после того, как её время уже обработано
+        lock_guard<mutex> ar(wakeMutex);
+        if (when > tick) {
+            wakeQueue.push(WakeEntry(when, node));
+            return;
+        }
+    }
+    processMap[node]->wake();
+}
+
+inline void NetworkLayer::wakeDue() {
+    vector<int> due;
+    {
+        lock_guard<mutex> ar(wakeMutex);
+        while (!wakeQueue.empty() && wakeQueue.top().first <= tick) {
+            due.push_back(wakeQueue.top().second);
+            wakeQueue.pop();
+        }
+    }
+    for (int node: due) processMap[node]->wake();
+}
+
+inline void NetworkLayer::fireTimers() {
+    vector<Message> fired;
+    {
+        lock_guard<mutex> ar(timersMutex);
+        if (timers.size() == 0) return;
+        timers.advance(tick, [&fired](Message &m) { fired.push_back(move(m)); });
+        // Сработавшие таймеры считаются сообщениями в пути до снятия блокировки - иначе 
+        // isQuiescent() может на мгновение не увидеть ни таймера, ни сообщения
+        inFlight += (int64)fired.size();
+    }
+    for (auto &m: fired) {
+        inFlight--;
+        DSS_STAT(countEnqueued(m.to));
+        enqueue(m);
+    }
+}
+
+inline int64 NetworkLayer::setTimer(int node, int64 delay, Message const &msg) {
+    if (node < 0 || node >= (int)processMap.size() || processMap[node] == nullptr) return -1;
+    Message m(node, node, msg.body, msg.type);
+    m.origin = node;
+    m.seq = nextSeq(node);
+    m.sendTime = now();
+    if (delay < 0) delay = 0;
+    if (mode == Synchronous && delay < 1) delay = 1;
+    m.deliveryTime = m.sendTime + delay;
+    uint64 key = timerKey(node, m.seq);
+    if (tracer) trace(TraceTimer, m, 0, m.deliveryTime);
+    if (mode == Replay) {
+        replay->post(m);
+    } else if (mode == Virtual || mode == Parallel) {
+        preparePartitions();
+        partitions[partitionOf(node)].timers.arm(key, m.deliveryTime, m);
+    } else if (mode == Synchronous) {
+        prepareRounds();
+        roundTimers[chunkOf(node)].arm(key, m.deliveryTime, m);
+    } else if (m.deliveryTime <= tick) {
+        // Время уже наступило - доставляем сразу, такой таймер отменить нельзя
+        DSS_STAT(countEnqueued(node));
+        enqueue(m);
+    } else {
+        lock_guard<mutex> ar(timersMutex);
+        timers.arm(key, m.deliveryTime, m);
+    }
+    return m.seq;
+}
+
+inline void NetworkLayer::saveHeader(CheckpointHeader &h) const {
+    h.mode = mode;
+    h.tick = tick;
+    h.externalSeq = externalSeq;
+    h.baseSeed = baseSeed;
+    h.seedStream = seedStream;
+    h.errorRate = errorRate;
+}
+
+// Реплика, как и по директиве mode, работает в виртуальном времени и сохраняет свой поток случайных чисел
+inline void NetworkLayer::loadHeader(CheckpointHeader const &h, bool replica) {
+    setMode(replica && h.mode != Synchronous ? (int)Virtual : h.mode);
+    tick = h.tick;
+    externalSeq = h.externalSeq;
+    if (!replica) setStream(h.seedStream);
+    setSeed(h.baseSeed);
+    errorRate = h.errorRate;
+}
+
+// Модели сбоев, число процессов топологии, затем связи в порядке CSR: from, to, latency, номер модели, 
+// состояние burst; затем периодические таймеры. Поля LinkFault пишутся по одному - в структуре есть выравнивание.
+inline void NetworkLayer::saveNetwork(CheckpointWriter &w) {
+    Topology const &t = topology();
+    w.put((uint32)t.faults.size());
+    for (auto const &f: t.faults) {
+        w.put(f.loss); w.put(f.dup); w.put((int32)f.jitter);
+        w.put(f.toBad); w.put(f.toGood); w.put(f.badLoss);
+    }
+    w.put((int32)t.size());
+    w.put((uint64)t.targets.size());
+    for (int from = 0; from < t.size(); from++) {
+        for (int e = t.offsets[from]; e < t.offsets[from + 1]; e++) {
+            w.put((int32)from); w.put((int32)t.targets[e]); w.put((int32)t.latency[e]); 
+            w.put((int32)t.fault[e]); w.put(t.burst[e]);
+        }
+    }
+    w.put((uint32)tickers.size());
+    for (auto const &tk: tickers) {
+        w.put(tk.period); w.put(tk.next); w.put((int32)tk.counter);
+    }
+}
+
+// Связи проверяются до замены топологии, как при импорте (importLinks): концы в пределах записанной 
+// топологии и без петель, задержка не отрицательна, порядок CSR строгий (без повторов). Иначе снимок отвергается.
+inline bool NetworkLayer::loadNetwork(CheckpointReader &r) {
+    uint32 count;
+    int32 nodes;
+    uint64 edges;
+    vector<LinkFault> faults;
+    if (!r.get(count)) return false;
+    for (uint32 i = 0; i < count; i++) {
+        LinkFault f;
+        int32 jitter = 0;
+        r.get(f.loss); r.get(f.dup); r.get(jitter);
+        r.get(f.toBad); r.get(f.toGood); r.get(f.badLoss);
+        f.jitter = jitter;
+        faults.push_back(f);
+    }
+    if (!r.get(nodes) || !r.get(edges) || faults.empty() || nodes < networkSize) return false;
+    vector<Link> loaded;
+    vector<byte> burst;
+    for (uint64 i = 0; i < edges; i++) {
+        int32 from, to, latency, fault;
+        byte b;
+        if (!r.get(from) || !r.get(to) || !r.get(latency) || !r.get(fault) || !r.get(b)) return false;
+        bool ordered = loaded.empty() || loaded.back().from < from || (loaded.back().from == from && loaded.back().to < to);
+        if (from < 0 || to < 0 || from >= nodes || to >= nodes || from == to || latency < 0 || !ordered ||
+            fault < 0 || fault >= (int32)faults.size()) {
+            printf("invalid link %d -> %d (latency %d) in checkpoint\n", from, to, latency);
+            return false;
+        }
+        loaded.push_back(Link{from, to, latency, fault});
+        burst.push_back(b);
+    }
+    {
+        lock_guard<mutex> ar(topologyMutex);
+        links = move(loaded);
+        faultModels = move(faults);
+        topologyDirty = true;
+    }
+    // Связи записаны в порядке CSR, поэтому номера связей нового представления совпадают с записанными
+    Topology const &t = topology();
+    if (t.burst.size() != burst.size()) return false;
+    t.burst = burst;
+    tickers.clear();
+    if (!r.get(count)) return false;
+    for (uint32 i = 0; i < count; i++) {
+        Ticker tk;
+        int32 counter = 0;
+        r.get(tk.period); r.get(tk.next); r.get(counter);
+        tk.counter = counter;
+        tickers.push_back(tk);
+    }
+    return r.good();
+}
+
+// Сообщения в пути, затем таймеры процессов (время срабатывания и сообщение). Сообщения упорядочены 
+// по времени доставки и ключу, таймеры - по ключу, поэтому снимок не зависит от числа потоков.
+inline void NetworkLayer::saveEvents(CheckpointWriter &w) {
+    vector<Message> pending;
+    vector<pair<int64, Message> > armed;
+    auto collect = [&armed](uint64, int64 expiry, Message const &m) { armed.push_back(make_pair(expiry, m)); };
+    if (mode == Synchronous) {
+        for (auto const &row: roundPrev) pending.insert(pending.end(), row.begin(), row.end());
+        for (auto const &t: roundTimers) t.forEach(collect);
+    } else {
+        for (auto const &p: partitions) {
+            EventCalendar c = p.calendar;
+            for (; !c.empty(); c.pop()) pending.push_back(c.top());
+            for (auto const &out: p.out)
+                for (auto const &v: out) pending.insert(pending.end(), v.begin(), v.end());
+            p.timers.forEach(collect);
+        }
+    }
+    sort(pending.begin(), pending.end(), [](Message const &a, Message const &b) { return b > a; });
+    sort(armed.begin(), armed.end(), [](pair<int64, Message> const &a, pair<int64, Message> const &b) {
+        return a.second.to != b.second.to ? a.second.to < b.second.to : a.second.seq < b.second.seq;
+    });
+    w.put((uint64)pending.size());
+    for (auto const &m: pending) w.putMessage(m);
+    w.put((uint64)armed.size());
+    for (auto const &a: armed) {
+        w.put(a.first);
+        w.putMessage(a.second);
+    }
+}
+
+// Процессы уже созданы: сообщения раскладываются по календарям частей или строкам раунда, как отправки извне
+inline bool NetworkLayer::loadEvents(CheckpointReader &r) {
+    uint64 count;
+    if (!r.get(count)) return false;
+    for (uint64 i = 0; i < count; i++) {
+        Message m(-1, -1, Payload());
+        if (!r.getMessage(m)) return false;
+        if (m.to < 0 || m.to >= (int)processMap.size()) continue;
+        if (mode == Synchronous) postToRound(m);
+        else postEvent(m);
+    }
+    if (!r.get(count)) return false;
+    for (uint64 i = 0; i < count; i++) {
+        int64 expiry;
+        Message m(-1, -1, Payload());
+        if (!r.get(expiry) || !r.getMessage(m)) return false;
+        if (m.to < 0 || m.to >= (int)processMap.size()) continue;
+        if (mode == Synchronous) {
+            prepareRounds();
+            roundTimers[chunkOf(m.to)].arm(timerKey(m.to, m.seq), expiry, m);
+        } else {
+            preparePartitions();
+            partitions[partitionOf(m.to)].timers.arm(timerKey(m.to, m.seq), expiry, m);
+        }
+    }
+    return r.good();
+}
+
+inline bool NetworkLayer::cancelTimer(int node, int64 id) {
+    uint64 key = timerKey(node, id);
+    // Отмена удалась в записанном прогоне, если таймер так и не сработал
+    if (mode == Replay) return replay->expected.count(TraceKey{node, node, id}) == 0;
+    if (mode == Virtual || mode == Parallel) 
+        return !partitions.empty() && partitions[partitionOf(node)].timers.cancel(key);
+    if (mode == Synchronous) 
+        return !roundTimers.empty() && roundTimers[chunkOf(node)].cancel(key);
+    lock_guard<mutex> ar(timersMutex);
+    return timers.cancel(key);
+}
+
+inline int64 NetworkLayer::nextSeq(int fromProcess) {
+    if (fromProcess >= 0 && fromProcess < (int)processMap.size() && processMap[fromProcess] != nullptr)
+        return processMap[fromProcess]->sendSeq++;
+    return externalSeq++;
+}
+
+inline int NetworkLayer::transmit(Message &m) {
+    TopologyReader reader(*this);
+    if (mode == Replay) return replayTransmit(m);
+    if (errorRate > 0 && lossDraw(m.origin, m.seq, SaltLoss) < errorRate) {
+        drop(m, DropLoss);
+        return ErrorCode::TimeOut;
+    }
+    if (queueMap[m.to] == nullptr) {
+        drop(m, DropNoRoute);
+        return ErrorCode::ItemNotFound;
+    }
+    int latency = 0;
+    LinkFault const *f = nullptr;
+#if DSSIMUL_STATS
+    LinkStats *ls = nullptr;
+#endif
+    if (m.from >= 0 && m.from != m.to) {
+        Topology const &t = topology();
+        int e = t.edge(m.from, m.to);
+        if (e < 0) {
+            drop(m, DropNoRoute);
+            return ErrorCode::ItemNotFound;
+        }
+        DSS_STAT(ls = &t.linkStats[e]);
+        latency = t.latency[e];
+        if (t.fault[e] != 0) {
+            f = &t.faults[t.fault[e]];
+            double loss = f->loss;
+            if (f->toBad > 0) {
+                byte &bad = t.burst[e];
+                bad = lossDraw(m.origin, m.seq, SaltBurst) < (bad ? 1.0 - f->toGood : f->toBad);
+                if (bad) loss = f->badLoss;
+            }
+            if (loss > 0 && lossDraw(m.origin, m.seq, SaltLinkLoss) < loss) {
+                drop(m, DropLinkLoss);
+                DSS_STAT(ls->dropped++);
+                return ErrorCode::TimeOut;
+            }
+        }
+    }
+    m.sendTime = now();
+    // В синхронном режиме сообщение всегда доставляется в следующем раунде, случайная задержка не действует
+    if (mode == Synchronous) m.deliveryTime = m.sendTime + 1;
+    else {
+        m.deliveryTime = m.sendTime + latency;
+        if (f != nullptr && f->jitter > 0) 
+            m.deliveryTime += (int64)(lossDraw(m.origin, m.seq, SaltJitter) * (f->jitter + 1));
+    }
+    post(m);
+    if (tracer) trace(TraceSend, m, 0, m.deliveryTime);
+    DSS_STAT(if (ls != nullptr) ls->sent++);
+    if (f != nullptr && f->dup > 0 && lossDraw(m.origin, m.seq, SaltDup) < f->dup) {
+        DSS_STAT(ls->duplicated++);
+        // Копия с тем же номером; своя случайная задержка может доставить её раньше оригинала
+        if (mode != Synchronous && f->jitter > 0) 
+            m.deliveryTime = m.sendTime + latency + (int64)(lossDraw(m.origin, m.seq, SaltDupJitter) * (f->jitter + 1));
+        post(m);
+        if (tracer) trace(TraceSend, m, 1, m.deliveryTime);
+    }
+    return ErrorCode::OK;
+}
+
+// Воспроизведение: потери - по трассе, время доставки задаёт трасса, копии (dup) - число её доставок
+inline int NetworkLayer::replayTransmit(Message &m) {
+    auto d = replay->drops.find(TraceKey{m.origin, m.to, m.seq});
+    if (d != replay->drops.end()) {
+        drop(m, (DropReason)d->second);
+        return d->second == DropNoRoute ? ErrorCode::ItemNotFound : ErrorCode::TimeOut;
+    }
+    m.sendTime = m.deliveryTime = now();
+    post(m);
     return ErrorCode::OK;
 }
 
-void timerSender(NetworkLayer *nl, int time) {
-    int current = 0;
-    while (!nl->stopFlag) {
-        nl->send(-1, -1, Message("*TIME", current++));
-        this_thread::sleep_for(chrono::seconds(time));
+#if DSSIMUL_STATS
+inline void NetworkLayer::countDrop(int fromProcess, DropReason reason) {
+    if (fromProcess >= 0 && fromProcess < (int)processMap.size() && processMap[fromProcess] != nullptr)
+        processMap[fromProcess]->stats.drops[reason]++;
+    else externalDrops[reason].fetch_add(1, memory_order_relaxed);
+}
+
+inline void NetworkLayer::countEnqueued(int node) {
+    if (node >= 0 && node < (int)processMap.size() && processMap[node] != nullptr)
+        processMap[node]->stats.enqueued.fetch_add(1, memory_order_relaxed);
+}
+#endif
+
+// Счётчики процесса меняет только поток, исполняющий его обработчик, поэтому блокировки не нужны
+inline void NetworkLayer::countSent(int fromProcess, bool lost) {
+    if (fromProcess >= 0 && fromProcess < (int)processMap.size() && processMap[fromProcess] != nullptr) {
+        Process *p = processMap[fromProcess];
+        p->sentCount++;
+        if (lost) p->lostCount++;
+    } else {
+        externalSent++;
+        if (lost) externalLost++;
+    }
+}
+
+inline int64 NetworkLayer::sentMessages() const {
+    int64 n = externalSent;
+    for (auto p: processMap) 
+        if (p != nullptr) n += p->sentCount;
+    return n;
+}
+
+inline int64 NetworkLayer::lostMessages() const {
+    int64 n = externalLost;
+    for (auto p: processMap) 
+        if (p != nullptr) n += p->lostCount;
+    return n;
+}
+
+inline StatsSnapshot NetworkLayer::stats() {
+    TopologyReader reader(*this);
+    StatsSnapshot s;
+    s.tick = tick;
+    s.externalSent = externalSent;
+    for (int node = 0; node < (int)processMap.size(); node++) {
+        Process const *p = processMap[node];
+        if (p == nullptr || !owns(node)) continue;
+        StatsSnapshot::ProcessRow r;
+        r.node = node;
+        r.sent = p->sentCount;
+        r.lost = p->lostCount;
+#if DSSIMUL_STATS
+        ProcessStats const &ps = p->stats;
+        r.enqueued = ps.enqueued.load(memory_order_relaxed);
+        r.delivered = ps.delivered;
+        r.unhandled = ps.unhandled;
+        r.pending = max<int64>(0, r.enqueued - r.delivered);
+        r.maxDepth = max<int64>(ps.maxDepth, r.pending);
+        for (int d = 0; d < DropReasons; d++) r.drops[d] = ps.drops[d];
+        for (int i = 0; i < Histogram::Buckets; i++) {
+            r.handlerNs[i] = ps.handlerNs.counts[i];
+            r.lateness[i] = ps.lateness.counts[i];
+        }
+#endif
+        s.processes.push_back(r);
+    }
+#if DSSIMUL_STATS
+    for (int d = 0; d < DropReasons; d++) s.externalDrops[d] = externalDrops[d].load(memory_order_relaxed);
+    // Только связи, по которым что-то отправлялось
+    Topology const &t = topology();
+    for (int from = 0; from < t.size(); from++) {
+        if (!owns(from)) continue;
+        Neighbors n = t.neighbors(from);
+        for (const int *to = n.begin(); to != n.end(); ++to) {
+            LinkStats const &ls = t.linkStats[n.edge(to)];
+            if (ls.sent == 0 && ls.dropped == 0) continue;
+            StatsSnapshot::LinkRow l;
+            l.from = from;
+            l.to = *to;
+            l.sent = ls.sent;
+            l.dropped = ls.dropped;
+            l.duplicated = ls.duplicated;
+            s.links.push_back(l);
+        }
+    }
+#endif
+    return s;
+}
+
+inline int64 NetworkLayer::runUntil(int64 limit, bool stopWhenIdle) {
+    if (mode == Synchronous) return runRounds(limit, stopWhenIdle);
+    if (mode == Replay) return runReplay(limit, stopWhenIdle);
+    return runPartitions(limit, stopWhenIdle);
+}
+
+inline bool NetworkLayer::isQuiescent() {
+    if (mode == RealTime) {
+        lock_guard<mutex> ar(timersMutex);
+        return inFlight == 0 && timers.size() == 0;
+    }
+    if (mode == Replay) return replay->remaining == 0 || replay->diverged;
+    if (mode == Synchronous) {
+        for (auto const &row: roundPrev)
+            if (!row.empty()) return false;
+        for (auto const &t: roundTimers)
+            if (t.size() > 0) return false;
+        return true;
+    }
+    if (transport != nullptr) return shardsIdle;
+    return isIdle(0) && isIdle(1);
+}
+
+inline bool NetworkLayer::waitQuiescent(int64 limit) {
+    unique_lock<mutex> ar(quiescentMutex);
+    for (;;) {
+        if (isQuiescent()) return true;
+        if (tick >= limit || stopFlag) return false;
+        // Уведомление приходит, когда число сообщений в пути падает до нуля; таймаут - для проверки limit
+        quiescentCv.wait_for(ar, chrono::milliseconds(50));
+    }
+}
+
+inline int64 NetworkLayer::Partition::nextTime() const {
+    int64 t = calendar.empty() ? -1 : calendar.top().deliveryTime;
+    for (auto const &tk: tickers)
+        if (t < 0 || tk.next < t) t = tk.next;
+    int64 due = timers.nextExpiry();
+    if (due >= 0 && (t < 0 || due < t)) t = due;
+    return t;
+}
+
+inline void NetworkLayer::preparePartitions(int count) {
+    if (transport != nullptr) {
+        partitions.back().last = max(partitions.back().last, (int)processMap.size());
+        return;
+    }
+    if (count <= 0) count = partitions.empty() ? 1 : (int)partitions.size();
+    int nodes = (int)processMap.size();
+    count = max(1, min(count, nodes));
+    if (count == (int)partitions.size() && nodes == partitionNodes) return;
+    // Изменилось число частей или процессов - перераспределяем ещё не доставленные события и таймеры
+    vector<Message> pending, pendingTimers;
+    for (auto &p: partitions) {
+        while (!p.calendar.empty()) {
+            pending.push_back(move(const_cast<Message &>(p.calendar.top())));
+            p.calendar.pop();
+        }
+        p.timers.drain([&pendingTimers](uint64, int64, Message &m) { pendingTimers.push_back(move(m)); });
+    }
+    partitions.clear();
+    partitions.resize(count);
+    partitionNodes = nodes;
+    for (int i = 0; i < count; i++) {
+        Partition &p = partitions[i];
+        p.first = (int)(((int64)i * nodes + count - 1) / count);
+        p.last = (int)(((int64)(i + 1) * nodes + count - 1) / count);
+        p.out[0].resize(count);
+        p.out[1].resize(count);
+    }
+    for (auto &m: pending) postEvent(m);
+    for (auto &m: pendingTimers) 
+        partitions[partitionOf(m.to)].timers.arm(timerKey(m.to, m.seq), m.deliveryTime, m);
+}
+
+inline void NetworkLayer::postEvent(Message const &m) {
+    Partition *cur = currentPartition();
+    if (cur == nullptr) {
+        // Отправка извне (из файла конфигурации) - модель в этот момент не работает
+        preparePartitions();
+        partitions[partitionOf(m.to)].calendar.push(m);
+        return;
+    }
+    int dst = partitionOf(m.to);
+    if (&partitions[dst] == cur) cur->calendar.push(m);
+    else cur->out[cur->parity][dst].push_back(m);
+}
+
+// Минимальная задержка среди связей между разными частями. 
+// Пока сообщения внутри окна такой ширины не могут попасть в другую часть, части работают независимо.
+inline int64 NetworkLayer::computeLookahead() {
+    const int64 unbounded = numeric_limits<int64>::max();
+    if (partitions.size() <= 1) return unbounded;
+    Topology const &t = topology();
+    int64 lookahead = unbounded;
+    for (int from = 0; from < t.size(); from++) {
+        Neighbors n = t.neighbors(from);
+        for (const int *to = n.begin(); to != n.end(); ++to)
+            if (partitionOf(from) != partitionOf(*to)) lookahead = min(lookahead, (int64)t.latency[n.edge(to)]);
+    }
+    return lookahead;
+}
+
+inline void NetworkLayer::runPartition(Partition &p, int64 windowLast, bool idleStop) {
+    currentPartition() = &p;
+    int index = (int)(&p - partitions.data());
+    for (auto &src: partitions) {
+        auto &incoming = src.out[p.parity ^ 1][index];
+        for (auto &m: incoming) p.calendar.push(move(m));
+        incoming.clear();
+    }
+    for (;;) {
+        int64 when = p.calendar.empty() ? -1 : p.calendar.top().deliveryTime;
+        // Сработавшие таймеры становятся событиями календаря и упорядочиваются вместе с сообщениями
+        int64 due = p.timers.nextExpiry();
+        if (due >= 0 && due <= windowLast && (when < 0 || due <= when)) {
+            p.timers.advance(due, [this, &p](Message &m) { 
+                DSS_STAT(countEnqueued(m.to));
+                p.calendar.push(move(m)); 
+            });
+            continue;
+        }
+        // Если части не связаны между собой, часть, где остались только периодические *TIME, можно остановить
+        if (idleStop && when < 0 && due < 0) break;
+        Ticker *next = nullptr;
+        for (auto &t: p.tickers)
+            if (next == nullptr || t.next < next->next) next = &t;
+        if (next != nullptr && (when < 0 || next->next <= when)) {
+            if (next->next > windowLast) break;
+            // *TIME не проходит через сеть: он не теряется и не зависит от связей.
+            // Ключ (origin = -2, номер таймера и такта) одинаков для всех частей.
+            Message m("*TIME", next->counter);
+            m.sendTime = m.deliveryTime = next->next;
+            m.origin = -2;
+            m.seq = ((int64)(next - p.tickers.data()) << 32) | (uint32)next->counter;
+            for (int node = p.first; node < p.last; node++) {
+                if (processMap[node] == nullptr) continue;
+                m.to = node;
+                DSS_STAT(countEnqueued(node));
+                p.calendar.push(m);
+            }
+            next->counter++;
+            next->next += next->period;
+            continue;
+        }
+        if (when < 0 || when > windowLast) break;
+        p.clock = when;
+        Message m = move(const_cast<Message &>(p.calendar.top()));
+        p.calendar.pop();
+        Process *dp = m.to < (int)processMap.size() ? processMap[m.to] : nullptr;
+        if (dp != nullptr) dp->deliver(m);
+        p.handled++;
+    }
+    currentPartition() = nullptr;
+}
+
+inline int64 NetworkLayer::runPartitions(int64 limit, bool stopWhenIdle) {
+    if (shardCount > 1 && transport == nullptr) startShards();
+    if (transport != nullptr) return runShard(limit, stopWhenIdle);
+    preparePartitions(mode == Parallel ? pool.size() : 1);
+    int64 lookahead = computeLookahead();
+    if (lookahead <= 0) {
+        // Связь между частями без задержки - окно нулевой ширины, параллельное моделирование невозможно
+        printf("zero-latency link between partitions: running sequentially\n");
+        preparePartitions(1);
+        lookahead = computeLookahead();
+    }
+    for (auto &p: partitions) {
+        p.tickers = tickers;
+        p.handled = 0;
+    }
+    const bool unbounded = lookahead == numeric_limits<int64>::max();
+    int parity = 0;
+    bool idle = false;
+    for (;;) {
+        // Начало окна - самое раннее событие во всех частях, включая ещё не перенесённые сообщения между частями
+        int64 start = -1;
+        for (auto &p: partitions) {
+            int64 t = p.nextTime();
+            if (t >= 0 && (start < 0 || t < start)) start = t;
+            for (auto const &v: p.out[parity ^ 1])
+                for (auto const &m: v)
+                    if (start < 0 || m.deliveryTime < start) start = m.deliveryTime;
+        }
+        idle = isIdle(parity ^ 1);
+        if (start < 0 || start > limit || (stopWhenIdle && idle)) break;
+        // Окно [start, windowLast] включительно
+        int64 windowLast = (lookahead > limit - start) ? limit : start + lookahead - 1;
+        bool idleStop = stopWhenIdle && unbounded;
+        tick = start;
+        for (auto &p: partitions) p.parity = parity;
+        if (partitions.size() == 1) runPartition(partitions[0], windowLast, idleStop);
+        else pool.parallelFor((int)partitions.size(), [this, windowLast, idleStop](int i) { runPartition(partitions[i], windowLast, idleStop); });
+        parity ^= 1;
+    }
+    // Сообщения последнего окна переносим в календари, чтобы модель можно было продолжить
+    int64 handled = 0;
+    for (size_t dst = 0; dst < partitions.size(); dst++) {
+        for (auto &src: partitions) {
+            for (auto &m: src.out[parity ^ 1][dst]) partitions[dst].calendar.push(move(m));
+            src.out[parity ^ 1][dst].clear();
+        }
+    }
+    for (auto &p: partitions) handled += p.handled;
+    // Все части прошли одни и те же такты таймеров
+    tickers = partitions[0].tickers;
+    if (stopWhenIdle && idle) {
+        // Модель затихла: часы остаются на последнем событии
+        for (auto &p: partitions) 
+            if (p.clock > tick) tick = p.clock;
+    } else if (tick < limit) tick = limit;
+    return handled;
+}
+
+// Запуск шардов: части по числу шардов, затем fork(). Родитель становится шардом 0.
+// Без шардов (false) модель продолжает работу в одном процессе.
+inline bool NetworkLayer::startShards() {
+    int count = shardCount;
+    shardCount = 1;
+#ifndef _WIN32
+    if (tracer) {
+        printf("shards: tracing is not supported, running in one process\n");
+        return false;
+    }
+    if (pool.running()) {
+        printf("shards: worker threads already started, running in one process\n");
+        return false;
+    }
+    preparePartitions(count);
+    if (partitions.size() < 2) return false;
+    int64 lookahead = computeLookahead();
+    if (lookahead <= 0) {
+        printf("zero-latency link between shards: running in one process\n");
+        return false;
+    }
+    unique_ptr<ShardTransport> t(new ShardTransport);
+    if (!t->create((int)partitions.size())) {
+        printf("shards: can't map shared memory, running in one process\n");
+        return false;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    int index;
+    {
+        // В момент fork() поток глобального таймера не должен держать блокировки. globalTimerMutex он берёт
+        // только под timerSleepMutex; рекурсивный мьютекс в порождённом процессе было бы не отпустить.
+        lock_guard<mutex> a(timerSleepMutex);
+        lock_guard<mutex> b(timersMutex);
+        lock_guard<mutex> c(wakeMutex);
+        index = t->fork();
+    }
+    if (index < 0) {
+        perror("shards: fork");
+        exit(1);
+    }
+    if (index > 0) {
+        // В порождённом процессе потока таймера нет, ждать его нельзя. В прежнем timerSleep осталось его 
+        // ожидание, из-за которого notify_all() и деструктор ждали бы вечно: это условие не трогаем и больше 
+        // не используем (release), а потоки шарда ждут на новом.
+        globalTimer.detach();
+        timerSleep.release();
+        timerSleep.reset(new condition_variable);
+    }
+    // Строки шардов не перемешиваются: каждая пишется одним вызовом write()
+    setvbuf(stdout, nullptr, _IOLBF, 0);
+    for (int i = 0; i < (int)partitions.size(); i++) {
+        if (i == index) continue;
+        Partition &p = partitions[i];
+        p.calendar = EventCalendar();
+        p.timers = TimerWheel();
+    }
+    shardCount = (int)partitions.size();
+    shard = index;
+    shardLookahead = lookahead;
+    transport = move(t);
+    return true;
+#else
+    printf("shards are not supported on this platform\n");
+    (void)count;
+    return false;
+#endif
+}
+
+// Окна шардов - как в runPartitions, только части исполняют разные процессы ОС. Раунд: барьер (все закончили 
+// окно, буферы заполнены) -> забрать входящие -> выложить итог -> барьер -> по итогам всех шардов каждый 
+// принимает одно и то же решение: следующее окно или конец.
+inline int64 NetworkLayer::runShard(int64 limit, bool stopWhenIdle) {
+    int64 handled = 0;
+#ifndef _WIN32
+    Partition &p = partitions[shard];
+    p.tickers = tickers;
+    p.handled = 0;
+    const bool unbounded = shardLookahead == numeric_limits<int64>::max();
+    auto receive = [this] { receiveShard(); };
+    int64 clock = 0;
+    bool idle = false;
+    for (;;) {
+        transport->barrier(receive);
+        receiveShard();
+        ShardTransport::Summary &mine = transport->summary(shardRound, shard);
+        mine.next = p.nextTime();
+        mine.clock = p.clock;
+        mine.handled = p.handled;
+        mine.idle = p.calendar.empty() && p.timers.size() == 0;
+        transport->barrier(receive);
+        int64 start = -1;
+        handled = clock = 0;
+        idle = true;
+        for (int i = 0; i < transport->count(); i++) {
+            ShardTransport::Summary const &s = transport->summary(shardRound, i);
+            if (s.next >= 0 && (start < 0 || s.next < start)) start = s.next;
+            handled += s.handled;
+            clock = max(clock, s.clock);
+            idle = idle && s.idle;
+        }
+        shardRound++;
+        if (start < 0 || start > limit || (stopWhenIdle && idle)) break;
+        int64 windowLast = (shardLookahead > limit - start) ? limit : start + shardLookahead - 1;
+        tick = start;
+        runPartition(p, windowLast, stopWhenIdle && unbounded);
+    }
+    tickers = p.tickers;
+    shardsIdle = idle;
+    if (stopWhenIdle && idle) {
+        if (clock > tick) tick = clock;
+    } else if (tick < limit) tick = limit;
+#endif
+    return handled;
+}
+
+// Сообщение процессу другого шарда. Время его доставки позже конца окна, поэтому получатель переносит его 
+// в календарь когда угодно. Пока буфер к получателю полон, забираем свои входящие: иначе два шарда, 
+// пишущие друг другу, ждали бы вечно.
+inline void NetworkLayer::toShard(Message const &m) {
+#ifndef _WIN32
+    if (!ShardTransport::fits(m)) {
+        drop(m, DropSizeTooBig);
+        return;
+    }
+    int dst = partitionOf(m.to);
+    for (int spin = 0; !transport->push(dst, m); spin++) {
+        receiveShard();
+        transport->backoff(spin);
+    }
+#else
+    (void)m;
+#endif
+}
+
+inline void NetworkLayer::receiveShard() {
+#ifndef _WIN32
+    Partition &p = partitions[shard];
+    transport->receive([this, &p](Message &&m) {
+        DSS_STAT(countEnqueued(m.to));
+        p.calendar.push(move(m));
+    });
+#endif
+}
+
+// Нет ни сообщений в календарях и между частями, ни таймеров процессов (периодические *TIME не в счёт)
+inline bool NetworkLayer::isIdle(int parity) const {
+    for (auto const &p: partitions) {
+        if (!p.calendar.empty() || p.timers.size() > 0) return false;
+        for (auto const &v: p.out[parity])
+            if (!v.empty()) return false;
+    }
+    return true;
+}
+
+inline void NetworkLayer::prepareRounds() {
+    int nodes = (int)processMap.size();
+    if (nodes == roundNodes || nodes == 0) return;
+    // Число процессов изменилось - перераспределяем ещё не доставленные сообщения по новым отрезкам
+    vector<Message> pending, pendingTimers;
+    for (auto &row: roundPrev) {
+        for (auto &m: row) pending.push_back(move(m));
+    }
+    for (auto &t: roundTimers) 
+        t.drain([&pendingTimers](uint64, int64, Message &m) { pendingTimers.push_back(move(m)); });
+    roundNodes = nodes;
+    roundChunks = min(nodes, pool.size() * 8);
+    roundPrev.assign((roundChunks + 1) * roundChunks, vector<Message>());
+    roundNext.assign((roundChunks + 1) * roundChunks, vector<Message>());
+    roundInbox.resize(nodes);
+    roundTimers.assign(roundChunks, TimerWheel());
+    for (auto &m: pending) postToRound(m);
+    for (auto &m: pendingTimers) roundTimers[chunkOf(m.to)].arm(timerKey(m.to, m.seq), m.deliveryTime, m);
+}
+
+inline void NetworkLayer::postToRound(Message const &m) {
+    prepareRounds();
+    vector<Message> *row = roundOutbox();
+    if (row != nullptr) row[chunkOf(m.to)].push_back(m);
+    else roundPrev[roundChunks * roundChunks + chunkOf(m.to)].push_back(m);
+}
+
+inline void NetworkLayer::runChunk(int chunk, vector<Message> const &timeMessages) {
+    int first = (int)(((int64)chunk * roundNodes + roundChunks - 1) / roundChunks);
+    int last = (int)(((int64)(chunk + 1) * roundNodes + roundChunks - 1) / roundChunks);
+    roundTimers[chunk].advance(tick, [this](Message &m) { 
+        DSS_STAT(countEnqueued(m.to));
+        roundInbox[m.to].push_back(move(m)); 
+    });
+    for (auto const &t: timeMessages) {
+        for (int node = first; node < last; node++) {
+            if (processMap[node] == nullptr) continue;
+            DSS_STAT(countEnqueued(node));
+            roundInbox[node].push_back(t);
+            roundInbox[node].back().to = node;
+        }
+    }
+    for (int src = 0; src <= roundChunks; src++) {
+        for (auto &m: roundPrev[src * roundChunks + chunk]) roundInbox[m.to].push_back(move(m));
+        roundPrev[src * roundChunks + chunk].clear();
+    }
+    roundOutbox() = &roundNext[chunk * roundChunks];
+    int64 handled = 0;
+    for (int node = first; node < last; node++) {
+        vector<Message> &inbox = roundInbox[node];
+        if (inbox.empty()) continue;
+        // Порядок доставки внутри раунда не зависит от числа потоков и порядка их работы
+        stable_sort(inbox.begin(), inbox.end(), [](Message const &a, Message const &b) {
+            return a.origin != b.origin ? a.origin < b.origin : a.seq < b.seq;
+        });
+        for (auto &m: inbox) {
+            if (processMap[node] != nullptr) processMap[node]->deliver(m);
+            handled++;
+        }
+        inbox.clear();
+    }
+    roundOutbox() = nullptr;
+    roundHandled += handled;
+}
+
+inline int64 NetworkLayer::runRounds(int64 limit, bool stopWhenIdle) {
+    prepareRounds();
+    roundHandled = 0;
+    bool idle = false;
+    while (tick < limit && roundNodes > 0) {
+        bool pending = false;
+        for (auto const &row: roundPrev) 
+            if (!row.empty()) { pending = true; break; }
+        int64 round = tick + 1;
+        if (!pending) {
+            if (stopWhenIdle && isQuiescent()) { idle = true; break; }
+            // Сообщений нет - сразу переходим к раунду ближайшего таймера
+            int64 next = limit;
+            for (auto const &t: tickers) next = min(next, t.next);
+            for (auto const &t: roundTimers) 
+                if (t.nextExpiry() >= 0) next = min(next, t.nextExpiry());
+            if (next > round) {
+                tick = next - 1;
+                continue;
+            }
+        }
+        vector<Message> timeMessages;
+        for (auto &t: tickers) {
+            if (t.next > round) continue;
+            t.next += t.period;
+            // Ключ *TIME - как в режиме Virtual: origin = -2, номер таймера и такта
+            Message m("*TIME", t.counter);
+            m.sendTime = m.deliveryTime = round;
+            m.origin = -2;
+            m.seq = ((int64)(&t - tickers.data()) << 32) | (uint32)t.counter++;
+            timeMessages.push_back(m);
+        }
+        tick = round;
+        pool.parallelFor(roundChunks, [this, &timeMessages](int chunk) { runChunk(chunk, timeMessages); });
+        swap(roundPrev, roundNext);
+    }
+    if (!idle && tick < limit) tick = limit;
+    return roundHandled;
+}
+
+inline int64 NetworkLayer::runReplay(int64 limit, bool stopWhenIdle) {
+    ReplayLog &r = *replay;
+    int64 handled = 0;
+    while (!r.diverged && !r.ready.empty() && r.ready.top().first <= limit) {
+        int node = r.ready.top().second;
+        r.ready.pop();
+        ReplayLog::Delivery const &d = r.deliveries[node][r.cursor[node]];
+        auto it = r.pending.find(d.key);
+        Message m = it->second;
+        if (--r.expected[d.key] == 0) r.pending.erase(it);
+        r.remaining--;
+        r.cursor[node]++;
+        tick = d.time;
+        m.to = node;
+        m.deliveryTime = d.time;
+        Process *dp = node < (int)processMap.size() ? processMap[node] : nullptr;
+        string name = d.type >= 0 && d.type < (int)r.types.size() ? r.types[d.type] : string();
+        if (dp == nullptr || name != MessageTypes::name(m.type)) {
+            printf("replay diverged: process %d expected '%s' from %d (seq %lld) at %lld\n", 
+                node, name.c_str(), d.key.origin, d.key.seq, d.time);
+            r.diverged = true;
+            break;
+        }
+        dp->deliver(m);
+        handled++;
+        r.schedule(node);
+    }
+    // Доставка, время которой наступило, не может ждать сообщения позже себя - иначе прогон разошёлся с трассой
+    for (int node = 0; node < (int)r.deliveries.size() && !r.diverged; node++) {
+        if (r.cursor[node] >= r.deliveries[node].size()) continue;
+        ReplayLog::Delivery const &d = r.deliveries[node][r.cursor[node]];
+        if (d.time > limit || !r.waiting.count(d.key)) continue;
+        printf("replay diverged: process %d waits for message from %d (seq %lld) at %lld\n", 
+            node, d.key.origin, d.key.seq, d.time);
+        r.diverged = true;
+    }
+    if (!(stopWhenIdle && isQuiescent()) && tick < limit) tick = limit;
+    return handled;
+}
+
+inline void NetworkLayer::launchTimer(int period) {
+    // При воспроизведении *TIME берутся из трассы
+    if (mode == Replay) return;
+    if (mode != RealTime) {
+        addTicker(period);
+        return;
     }
+    if (period <= 0) return;
+    lock_guard<mutex> ar(timerSleepMutex);
+    tickerThreads.push_back(thread([this, period] {
+        int current = 0;
+        unique_lock<mutex> sleeping(timerSleepMutex);
+        while (!stopFlag) {
+            sleeping.unlock();
+            send(-1, -1, Message("*TIME", current++));
+            sleeping.lock();
+            timerSleep->wait_for(sleeping, chrono::seconds(period), [this] { return stopFlag; });
+        }
+    }));
 }
 
 class World {
 public:
     ~World() {
+        nl.shutdown();
         for (auto &p: processesList) {
             if (p != nullptr) {
                 delete p; p = nullptr;
@@ -329,57 +3595,426 @@ public:
         if (it == associates.end()) return ErrorCode::ItemNotFound;
         if (dp == nullptr) return ErrorCode::ItemNotFound;
         dp->registerWorkFunction(func, it->second);
+        auto c = contextsOf.find(func);
+        if (c != contextsOf.end())
+            for (auto type: c->second) nl.context(dp, *type);
         return ErrorCode::OK;
     }
-    void registerWorkFunction(string const &func, workFunction wf) {
+    // Рабочая функция func; Contexts - типы её контекстов, они создаются каждому процессу, которому она назначена
+    template<class... Contexts> void registerWorkFunction(string const &func, workFunction wf) {
         associates[func] = wf; 
+        contextsOf[func] = {&ContextType::of<Contexts>()...};
+    }
+    // Обойти контексты типа T: f(node, context) в порядке создания. Только при остановленной модели.
+    template<class T, class F> void forEachContext(F f) {
+        ContextArray const *a = nl.contexts(ContextType::of<T>());
+        if (a == nullptr) return;
+        for (size_t i = 0; i < a->size(); i++) f(a->node(i), *(T *)a->at(i));
     }
     vector<Process *> processesList;
     map<string, workFunction> associates;
+    map<string, vector<ContextType const *> > contextsOf;
+    // Мир - одна из реплик пакетного прогона (см. ReplicaRunner): директивы mode, threads и trace не действуют
+    bool replica = false;
+    // Режимы Virtual и Synchronous: продвинуть модель до виртуального времени (номера раунда) limit
+    int64 run(int64 limit) {
+        return nl.runUntil(limit);
+    }
+    // Счётчики процессов и связей (пусты при сборке с DSSIMUL_STATS=0, кроме sent и lost)
+    StatsSnapshot stats() {
+        return nl.stats();
+    }
+    // Записать снимок статистики в файл: JSON, если имя оканчивается на .json или format == "json", иначе CSV
+    // С шардами каждый пишет статистику своих процессов; шард i > 0 - в файл "name.i"
+    bool dumpStats(string const &name, string const &format = "") {
+        string file = nl.shardIndex() > 0 ? name + "." + to_string(nl.shardIndex()) : name;
+        FILE *f = fopen(file.c_str(), "w");
+        if (f == nullptr) return false;
+        bool json = format == "json" || (format.empty() && name.size() > 5 && name.compare(name.size() - 5, 5, ".json") == 0);
+        StatsSnapshot s = stats();
+        bool ok = json ? s.writeJson(f) : s.writeCsv(f);
+        return fclose(f) == 0 && ok;
+    }
+    // Двоичная трасса прогона (см. TraceRecord); закрывается stopTrace() или при уничтожении мира
+    bool startTrace(string const &name) {
+        return nl.startTrace(name);
+    }
+    bool stopTrace() {
+        return nl.stopTrace();
+    }
+    // Воспроизвести трассу name. Вызывается до разбора того же файла конфигурации, что и в записанном прогоне:
+    // директивы mode, trace и launch timer, а также отправки извне (send from -1) при этом не действуют.
+    bool replay(string const &name) {
+        return nl.startReplay(name);
+    }
+    // Работать, пока в модели есть сообщения или таймеры процессов, но не дольше такта limit.
+    // Возвращает true, если модель затихла, и false, если вышло время.
+    bool runUntilQuiescent(int64 limit = numeric_limits<int64>::max()) {
+        if (nl.mode == NetworkLayer::RealTime) return nl.waitQuiescent(limit);
+        nl.runUntil(limit, true);
+        return nl.isQuiescent();
+    }
+    // Снимок модели: заголовок (CheckpointHeader), процессы с рабочими функциями и счётчиками, контексты, 
+    // топология и периодические таймеры, сообщения в пути и таймеры процессов. Контексты связываются с типами 
+    // по имени typeid и пишутся побайтно, поэтому снимок читает та же программа, и только тривиально копируемые
+    // контексты попадают в него (о прочих выводится предупреждение). Модель должна быть остановлена.
+    bool checkpoint(string const &name) {
+        if (!nl.canCheckpoint()) return false;
+        CheckpointHeader h;
+        nl.saveHeader(h);
+        CheckpointWriter w;
+        vector<Process *> procs;
+        for (auto p: processesList) 
+            if (p != nullptr) procs.push_back(p);
+        h.processes = (int32)procs.size();
+        w.put(h);
+        for (auto p: procs) {
+            vector<string> funcs = p->workFunctionNames();
+            w.put((int32)p->node); w.put(p->sendSeq); w.put(p->deliveries);
+            w.put((uint32)funcs.size());
+            for (auto const &f: funcs) w.putString(f);
+        }
+        vector<pair<ContextType const *, ContextArray const *> > arrays;
+        for (auto type: ContextType::all()) {
+            ContextArray const *a = nl.contexts(*type);
+            if (a == nullptr || a->size() == 0) continue;
+            if (type->trivial) arrays.push_back(make_pair(type, a));
+            else printf("context type '%s' is not trivially copyable: not saved\n", type->name);
+        }
+        w.put((uint32)arrays.size());
+        for (auto const &t: arrays) {
+            w.putString(t.first->name);
+            w.put((uint64)t.first->size); w.put((uint64)t.second->size());
+            for (size_t i = 0; i < t.second->size(); i++) {
+                w.put((int32)t.second->node(i));
+                w.putBytes(t.second->at(i), t.first->size);
+            }
+        }
+        nl.saveNetwork(w);
+        nl.saveEvents(w);
+        return w.save(name);
+    }
+    // Восстановить модель из снимка в мир без процессов; рабочие функции и типы контекстов должны быть 
+    // зарегистрированы (registerWorkFunction) до вызова. Директивы после restore продолжают модель.
+    bool restore(string const &name) {
+        for (auto p: processesList) 
+            if (p != nullptr) return false;
+        if (nl.mode == NetworkLayer::Replay) return false;
+        CheckpointReader r;
+        CheckpointHeader h;
+        if (!r.open(name) || !r.get(h) || !h.valid()) return false;
+        // Процессы читаются и проверяются целиком до создания: повтор номера отвергает снимок
+        struct SavedProcess {
+            int32 node;
+            int64 sendSeq, deliveries;
+            vector<string> funcs;
+        };
+        vector<SavedProcess> saved;
+        set<int> nodes;
+        for (int i = 0; i < h.processes; i++) {
+            SavedProcess sp;
+            uint32 count;
+            if (!r.get(sp.node) || !r.get(sp.sendSeq) || !r.get(sp.deliveries) || !r.get(count) || sp.node < 0) return false;
+            if (!nodes.insert(sp.node).second) {
+                printf("duplicate process %d in checkpoint\n", sp.node);
+                return false;
+            }
+            for (uint32 k = 0; k < count; k++) {
+                string func;
+                if (!r.getString(func)) return false;
+                sp.funcs.push_back(func);
+            }
+            saved.push_back(move(sp));
+        }
+        nl.loadHeader(h, replica);
+        for (auto const &sp: saved) {
+            createProcess(sp.node);
+            processesList[sp.node]->sendSeq = sp.sendSeq;
+            processesList[sp.node]->deliveries = sp.deliveries;
+            for (auto const &func: sp.funcs)
+                if (!func.empty() && assignWorkFunction(sp.node, func) != ErrorCode::OK) 
+                    printf("unknown work function '%s' in checkpoint\n", func.c_str());
+        }
+        uint32 types;
+        if (!r.get(types)) return false;
+        for (uint32 t = 0; t < types; t++) {
+            string typeName;
+            uint64 size, count;
+            if (!r.getString(typeName) || !r.get(size) || !r.get(count)) return false;
+            ContextType const *type = ContextType::find(typeName);
+            bool known = type != nullptr && type->size == size && type->trivial;
+            if (!known) printf("unknown context type '%s' in checkpoint: not restored\n", typeName.c_str());
+            for (uint64 i = 0; i < count; i++) {
+                int32 node;
+                if (!r.get(node)) return false;
+                if (!known || node >= (int)processesList.size() || processesList[node] == nullptr) {
+                    if (!r.skip(size)) return false;
+                } else if (!r.getBytes(nl.context(processesList[node], *type), size)) return false;
+            }
+        }
+        return nl.loadNetwork(r) && nl.loadEvents(r);
+    }
+    // link from <номер|all> to <номер|all> [latency N] [loss P] [dup P] [jitter N] [burst toBad toGood [badLoss]]
+    bool parseLink(const char *s, bool bidirectional) {
+        char a[32], b[32];
+        int pos = 0, latency = 1;
+        if (sscanf(s, "link from %31s to %31s%n", a, b, &pos) != 2) return false;
+        LinkFault f;
+        for (const char *p = s + pos; ; ) {
+            char key[32];
+            int n = 0, k = 0;
+            if (sscanf(p, "%31s%n", key, &n) != 1) break;
+            p += n;
+            if (strcmp(key, "latency") == 0 && sscanf(p, "%d%n", &latency, &k) == 1) {
+            } else if (strcmp(key, "loss") == 0 && sscanf(p, "%lf%n", &f.loss, &k) == 1) {
+            } else if (strcmp(key, "dup") == 0 && sscanf(p, "%lf%n", &f.dup, &k) == 1) {
+            } else if (strcmp(key, "jitter") == 0 && sscanf(p, "%d%n", &f.jitter, &k) == 1) {
+            } else if (strcmp(key, "burst") == 0 && sscanf(p, "%lf %lf%n", &f.toBad, &f.toGood, &k) == 2) {
+                int m = 0;
+                if (sscanf(p + k, "%lf%n", &f.badLoss, &m) == 1) k += m;
+            } else return false;
+            p += k;
+        }
+        int from = -1, to = -1;
+        bool fromAll = strcmp(a, "all") == 0, toAll = strcmp(b, "all") == 0;
+        if ((!fromAll && sscanf(a, "%d", &from) != 1) || (!toAll && sscanf(b, "%d", &to) != 1)) return false;
+        if (latency < 0) {
+            printf("negative link latency in input file: '%s'\n", s);
+            return true;
+        }
+        // Модель сбоев регистрируется один раз и хранится в связях. Повторная связь заменяет прежнюю 
+        // вместе с моделью: без параметров сбоев - связь без сбоев.
+        int fault = nl.faultModel(f);
+        if (fromAll && toAll) nl.addLinksAllToAll(latency, fault);
+        else if (fromAll) nl.addLinksFromAll(to, bidirectional, latency, fault);
+        else if (toAll) nl.addLinksToAll(from, bidirectional, latency, fault);
+        else nl.createLink(from, to, bidirectional, latency, fault);
+        return true;
+    }
+    // Очередное слово строки (до пробела или табуляции); p переходит за него
+    static bool nextWord(const char *&p, string &word) {
+        p += strspn(p, " \t");
+        size_t n = strcspn(p, " \t");
+        if (n == 0) return false;
+        word.assign(p, n);
+        p += n;
+        return true;
+    }
+    // topology ring|grid|torus|random-regular|erdos-renyi|scale-free n [параметр] [latency N] [seed N]
+    // topology edges файл [weighted] [latency N]
+    // Недостающие процессы 0..n-1 создаются. Зерно по умолчанию - из директивы seed.
+    bool parseTopology(const char *s, bool bidirectional) {
+        const char *p = s;
+        string word, file;
+        TopologySpec spec;
+        spec.seed = nl.baseSeed;
+        bool weighted = false;
+        int k = 0;
+        if (!nextWord(p, word) || !nextWord(p, spec.kind)) return false;
+        if (spec.kind == "edges") {
+            if (!nextWord(p, file)) return false;
+        } else {
+            if (sscanf(p, "%d%n", &spec.n, &k) != 1 || spec.n < 0) return false;
+            p += k;
+            if (sscanf(p, "%lf%n", &spec.param, &k) == 1) p += k;
+        }
+        while (nextWord(p, word)) {
+            if (word == "latency" && sscanf(p, "%d%n", &spec.latency, &k) == 1) p += k;
+            else if (word == "seed" && sscanf(p, "%llu%n", &spec.seed, &k) == 1) p += k;
+            else if (word == "weighted") weighted = true;
+            else return false;
+        }
+        if (spec.latency < 0) {
+            printf("negative link latency in input file: '%s'\n", s);
+            return true;
+        }
+        int n = spec.n;
+        if (spec.kind == "edges") {
+            int64 rc = nl.importLinks(file, weighted, bidirectional, spec.latency, n);
+            if (rc == -2) {
+                printf("negative link latency in edge list '%s'\n", file.c_str());
+                return true;
+            }
+            if (rc < 0) {
+                printf("can't read edge list '%s'\n", file.c_str());
+                return true;
+            }
+        } else if (nl.generateTopology(spec, bidirectional) < 0) return false;
+        for (int i = 0; i < n; i++)
+            if (i >= (int)processesList.size() || processesList[i] == nullptr) createProcess(i);
+        return true;
+    }
+    // Строка читается целиком, без ограничения длины. Директива определяется по первому слову,
+    // и к строке применяется только образец этой директивы.
+    // Файл читается в память целиком до разбора: директива wait может запустить шарды (fork), и порождённые
+    // процессы не должны делить с родителем позицию открытого файла.
     bool parseConfig(string const &name) {
-        ifstream f(name.c_str());
-        if (!f) return false;
-        char    s[1024];
+        string text, line, directive, id, msg;
+        {
+            ifstream f(name.c_str(), ios::binary);
+            if (!f) return false;
+            text.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+        }
         int bidirected = 1, timeout = 0;
-        while (!f.eof()) {
-            f.getline(s, sizeof s - 1);
-            if (strlen(s) == 0 || s[0] == ';') continue;
-            char id[1024], msg[1024];
+        for (size_t pos = 0, end; pos < text.size(); pos = end + 1) {
+            end = text.find('\n', pos);
+            if (end == string::npos) end = text.size();
+            line.assign(text, pos, end - pos);
+            if (!line.empty() && line[line.size() - 1] == '\r') line.erase(line.size() - 1);
+            const char *s = line.c_str(), *p = s;
+            if (!nextWord(p, directive) || directive[0] == ';') continue;
             double errorRate;
-            int startprocess, endprocess, from, to, latency = 1, timer = 0, arg;
-            if (sscanf(s, "bidirected %d", &bidirected) == 1) continue;
-            else if (sscanf(s, "errorRate %lf", &errorRate) == 1) nl.setErrorRate(errorRate);
-            else if (sscanf(s, "processes %d %d", &startprocess, &endprocess) == 2) {
-                for (int i = startprocess; i <= endprocess; i++)
-                    createProcess(i);
-            } else if (sscanf(s, "link from %d to %d latency %d", &from, &to, &latency) == 3 || 
-                sscanf(s, "link from %d to %d", &from, &to) == 2) { 
-                    nl.createLink(from, to, bidirected != 0, latency);
-            } else if (sscanf(s, "link from %d to all latency %d", &from, &latency) == 2 ||
-                sscanf(s, "link from %d to all", &from) == 1) {
-                    nl.addLinksToAll(from, bidirected != 0, latency);
-            } else if (sscanf(s, "link from all to %d latency %d", &from, &latency) == 2 || 
-                sscanf(s, "link from all to %d", &to) == 1) {
-                    nl.addLinksFromAll(from, bidirected != 0, latency);
-            } else if (strcmp(s, "link from all to all") == 0 || 
-                sscanf(s, "link from all to all latency %d", &latency) == 1) {
-                    nl.addLinksAllToAll(bidirected != 0, latency);
-            } else if (sscanf(s, "setprocesses %d %d %s", &startprocess, &endprocess, id) == 3) {
-                for (int i = startprocess; i <= endprocess; i++) assignWorkFunction(i, id);
-            } else if (sscanf(s, "send from %d to %d %s %d", &from, &to, msg, &arg) == 4) {
-                nl.send(from, to, Message(msg, arg));
-            } else if (sscanf(s, "send from %d to %d %s", &from, &to, msg) == 3) {
-                nl.send(from, to, Message(msg));
-            } else if (sscanf(s, "wait %d", &timeout)) {
-                this_thread::sleep_for(chrono::microseconds(1000000*timeout));
-            } else if (sscanf(s, "launch timer %d", &timer) == 1) {
-                thread(timerSender, &nl, timer).detach(); 
-            } else {
-                printf("unknown directive in input file: '%s'\n", s);
-            }
+            int startprocess, endprocess, from, to, timer = 0, arg, k = 0;
+            uint64 seed;
+            bool ok = true;
+            if (directive == "link") {
+                ok = parseLink(s, bidirected != 0);
+            } else if (directive == "bidirected") {
+                ok = sscanf(p, "%d", &bidirected) == 1;
+            } else if (directive == "errorRate") {
+                if ((ok = sscanf(p, "%lf", &errorRate) == 1)) nl.setErrorRate(errorRate);
+            } else if (directive == "seed") {
+                if ((ok = sscanf(p, "%llu", &seed) == 1)) nl.setSeed(seed);
+            } else if (directive == "processes") {
+                if ((ok = sscanf(p, "%d %d", &startprocess, &endprocess) == 2))
+                    for (int i = startprocess; i <= endprocess; i++)
+                        createProcess(i);
+            } else if (directive == "topology") {
+                ok = parseTopology(s, bidirected != 0);
+            } else if (directive == "setprocesses") {
+                if ((ok = sscanf(p, "%d %d%n", &startprocess, &endprocess, &k) == 2 && nextWord(p += k, id)))
+                    for (int i = startprocess; i <= endprocess; i++) assignWorkFunction(i, id);
+            } else if (directive == "send") {
+                if ((ok = sscanf(p, " from %d to %d%n", &from, &to, &k) == 2 && nextWord(p += k, msg))) {
+                    if (sscanf(p, "%d", &arg) == 1) nl.send(from, to, Message(msg, arg));
+                    else nl.send(from, to, Message(msg));
+                }
+            } else if (directive == "mode") {
+                ok = nextWord(p, id);
+                // Реплика всегда работает в виртуальном времени в одном потоке
+                if (!ok || nl.mode == NetworkLayer::Replay) {
+                } else if (replica && id != "synchronous") nl.setMode(NetworkLayer::Virtual);
+                else if (id == "virtual") nl.setMode(NetworkLayer::Virtual);
+                else if (id == "synchronous") nl.setMode(NetworkLayer::Synchronous);
+                else if (id == "parallel") nl.setMode(NetworkLayer::Parallel);
+                else if (id == "realtime") nl.setMode(NetworkLayer::RealTime);
+                else printf("unknown mode in input file: '%s'\n", id.c_str());
+            } else if (directive == "shards") {
+                if ((ok = sscanf(p, "%d", &arg) == 1) && !replica && nl.mode != NetworkLayer::Replay) nl.setShards(arg);
+            } else if (directive == "threads") {
+                if ((ok = sscanf(p, "%d", &arg) == 1) && !replica) nl.pool.setSize(arg);
+            } else if (directive == "dump") {
+                if ((ok = nextWord(p, id) && id == "stats" && nextWord(p, id))) {
+                    if (!nextWord(p, msg)) msg.clear();
+                    if (!dumpStats(id, msg)) printf("can't write statistics to '%s'\n", id.c_str());
+                }
+            } else if (directive == "trace") {
+                if ((ok = nextWord(p, id)) && nl.mode != NetworkLayer::Replay && !replica && !startTrace(id)) 
+                    printf("can't write trace to '%s'\n", id.c_str());
+            } else if (directive == "wait") {
+                if (sscanf(p, " quiescent%n", &k) >= 0 && k > 0) {
+                    if (sscanf(p + k, "%d", &timeout) == 1) runUntilQuiescent(nl.tick + timeout);
+                    else runUntilQuiescent();
+                } else if ((ok = sscanf(p, "%d", &timeout) == 1)) {
+                    if (nl.mode != NetworkLayer::RealTime) run(nl.tick + timeout);
+                    else this_thread::sleep_for(chrono::microseconds(1000000*timeout));
+                }
+            } else if (directive == "checkpoint") {
+                // Реплики одной конфигурации писали бы в один и тот же файл
+                if ((ok = nextWord(p, id)) && !replica && !checkpoint(id)) 
+                    printf("can't write checkpoint to '%s'\n", id.c_str());
+            } else if (directive == "restore") {
+                if ((ok = nextWord(p, id)) && !restore(id)) printf("can't restore checkpoint '%s'\n", id.c_str());
+            } else if (directive == "launch") {
+                if ((ok = sscanf(p, " timer %d", &timer) == 1)) nl.launchTimer(timer);
+            } else ok = false;
+            if (!ok) printf("unknown directive in input file: '%s'\n", s);
         }
-        f.close();
         return true;
     }
     NetworkLayer nl;
 };
+
+// Результат одной реплики пакетного прогона
+struct ReplicaResult {
+    int replica = 0;
+    uint64 seed = 0;            // итоговое зерно потерь: "seed" с этим числом повторяет реплику
+    bool quiescent = false;     // модель затихла раньше предела времени
+    int64 time = 0;             // время затихания (время сходимости) или предел
+    int64 sent = 0, lost = 0;
+    int64 outcome = -1;         // итог реплики по функции ReplicaRunner::outcome
+};
+
+// Пакетный режим (метод Монте-Карло): count независимых реплик одной модели с разными потоками
+// случайных чисел исполняются параллельно, по реплике на поток пула. Каждая реплика - отдельный World
+// в виртуальном времени с одним потоком, поэтому её результат не зависит от числа потоков и соседей.
+class ReplicaRunner {
+public:
+    explicit ReplicaRunner(int threads = 0) : pool(threads) {}
+    template<class... Contexts> void registerWorkFunction(string const &func, workFunction wf) {
+        associates[func] = wf;
+        contextsOf[func] = {&ContextType::of<Contexts>()...};
+    }
+    // Итог реплики, по которому проверяется согласие (например, избранный координатор или -1)
+    int64 (*outcome)(World &w) = nullptr;
+    // Предел виртуального времени реплики после разбора конфигурации
+    int64 limit = 3000;
+    // Прогнать count реплик конфигурации config; реплика i использует поток случайных чисел i зерна seed
+    vector<ReplicaResult> run(string const &config, int count, uint64 seed) {
+        vector<ReplicaResult> results(max(count, 0));
+        pool.parallelFor(count, [&](int i) {
+            World w;
+            w.replica = true;
+            w.nl.quiet = true;
+            w.nl.pool.setSize(1);
+            w.nl.setMode(NetworkLayer::Virtual);
+            w.nl.setSeed(seed);
+            w.nl.setStream(i);
+            w.associates = associates;
+            w.contextsOf = contextsOf;
+            ReplicaResult &r = results[i];
+            r.replica = i;
+            if (!w.parseConfig(config)) return;
+            r.seed = w.nl.lossSeed;
+            r.quiescent = w.runUntilQuiescent(w.nl.tick + limit);
+            r.time = w.nl.tick;
+            r.sent = w.nl.sentMessages();
+            r.lost = w.nl.lostMessages();
+            if (outcome != nullptr) r.outcome = outcome(w);
+        });
+        return results;
+    }
+    // Сводка: среднее и процентили по репликам, распределение итогов
+    static void report(vector<ReplicaResult> const &results, FILE *f = stdout) {
+        int n = (int)results.size(), quiescent = 0;
+        if (n == 0) return;
+        vector<int64> time, sent, lost;
+        map<int64, int> outcomes;
+        for (auto const &r: results) {
+            if (r.quiescent) quiescent++;
+            time.push_back(r.time);
+            sent.push_back(r.sent);
+            lost.push_back(r.lost);
+            outcomes[r.outcome]++;
+        }
+        fprintf(f, "replicas %d, quiescent %d (%.1f%%)\n", n, quiescent, 100.0 * quiescent / n);
+        summary(f, "time", time);
+        summary(f, "sent", sent);
+        summary(f, "lost", lost);
+        fprintf(f, "outcome:");
+        for (auto const &o: outcomes) fprintf(f, " %lld - %d (%.1f%%)", o.first, o.second, 100.0 * o.second / n);
+        fprintf(f, "\n");
+    }
+private:
+    static void summary(FILE *f, const char *name, vector<int64> &v) {
+        sort(v.begin(), v.end());
+        double sum = 0;
+        for (auto x: v) sum += (double)x;
+        auto at = [&v](double q) { return v[min(v.size() - 1, (size_t)(q * (double)v.size()))]; };
+        fprintf(f, "%-5s mean %.1f min %lld p50 %lld p90 %lld p99 %lld max %lld\n", name, sum / (double)v.size(), 
+            v.front(), at(0.5), at(0.9), at(0.99), v.back());
+    }
+    WorkerPool pool;
+    map<string, workFunction> associates;
+    map<string, vector<ContextType const *> > contextsOf;
+};
@@ -0,0 +1,349 @@
+﻿#include "DSSimul.h"
+#include <sys/resource.h>
+#include <sstream>
+
+// Набор воспроизводимых сценариев для измерения производительности модели:
+// граф (ring, grid, random-regular, star, all-to-all; также torus, erdos-renyi, scale-free) x размер x нагрузка (flood, echo, bully).
+// Для каждого сценария выводится строка: число событий, сообщений в секунду, процентили времени
+// обработки события, пиковая память и число потоков. Строки можно сохранить (-o) и сравнить
+// с прежним прогоном (-c), чтобы увидеть регрессию производительности.
+//
+// bench [-mode virtual|parallel|synchronous|realtime] [-threads N] [-graphs ring,grid,...]
+//       [-work flood,echo,bully] [-sizes 100,1000,...] [-o файл] [-c файл-эталон] [-threshold 10]
+
+// Гистограмма времени обработки событий (нс): по 8 отрезков на каждую степень двойки.
+// У каждого потока своя гистограмма, после прогона они суммируются.
+struct LatencyHistogram {
+    enum { Sub = 8, Buckets = 64 * Sub };
+    uint64 counts[Buckets];
+    uint64 events = 0;
+    LatencyHistogram() { memset(counts, 0, sizeof counts); }
+    static int bucket(uint64 ns) {
+        if (ns < Sub) return (int)ns;
+        int log = 63 - __builtin_clzll(ns);
+        return (log - 2) * Sub + (int)((ns >> (log - 3)) & (Sub - 1));
+    }
+    static uint64 lower(int b) {
+        if (b < Sub) return (uint64)b;
+        int log = b / Sub + 2;
+        return (1ULL << log) | ((uint64)(b % Sub) << (log - 3));
+    }
+    void add(uint64 ns) { counts[bucket(ns)]++; }
+    void merge(LatencyHistogram const &h) {
+        for (int i = 0; i < Buckets; i++) counts[i] += h.counts[i];
+        events += h.events;
+    }
+    uint64 percentile(double q) const {
+        uint64 total = 0, seen = 0;
+        for (int i = 0; i < Buckets; i++) total += counts[i];
+        if (total == 0) return 0;
+        uint64 rank = (uint64)(q * (double)(total - 1));
+        for (int i = 0; i < Buckets; i++) {
+            seen += counts[i];
+            if (seen > rank) return lower(i);
+        }
+        return lower(Buckets - 1);
+    }
+};
+
+// Статистика потока: время события - время работы обработчика нагрузки (вместе с отправкой его сообщений).
+// Ожидание между событиями (барьеры и окна параллельных режимов, такты realtime) в него не входит,
+// поэтому процентили сравнимы между режимами и числом потоков.
+struct ThreadStats {
+    LatencyHistogram hist;
+};
+mutex statsMutex;
+vector<unique_ptr<ThreadStats> > allStats;
+int statsEpoch = 0;
+
+ThreadStats &threadStats() {
+    static thread_local ThreadStats *ts = nullptr;
+    static thread_local int epoch = -1;
+    if (ts == nullptr || epoch != statsEpoch) {
+        lock_guard<mutex> ar(statsMutex);
+        allStats.emplace_back(new ThreadStats);
+        ts = allStats.back().get();
+        epoch = statsEpoch;
+    }
+    return *ts;
+}
+
+// Измеряет обработчик от своего создания до конца области видимости
+class EventTimer {
+public:
+    EventTimer() : ts(threadStats()), start(chrono::steady_clock::now()) {}
+    ~EventTimer() {
+        ts.hist.add((uint64)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+        ts.hist.events++;
+    }
+private:
+    ThreadStats &ts;
+    chrono::steady_clock::time_point start;
+};
+
+// Состояние нагрузок по номеру процесса. Обработчики одного процесса не исполняются одновременно,
+// поэтому элементы массивов не требуют синхронизации.
+struct BenchState {
+    vector<char> seen;
+    vector<int> parent, received;
+    vector<int64> timer;
+    vector<int> coord;
+    void reset(int n) {
+        seen.assign(n, 0);
+        parent.assign(n, -1);
+        received.assign(n, 0);
+        timer.assign(n, -1);
+        coord.assign(n, -1);
+    }
+} state;
+
+// flood: получив сообщение впервые, процесс пересылает его всем соседям
+int workFunction_FLOOD(Process *dp, Message &) {
+    EventTimer timer;
+    if (state.seen[dp->node]) return true;
+    state.seen[dp->node] = 1;
+    Message flood("FLOOD");
+    for (auto n: dp->neibs()) dp->networkLayer->send(dp->node, n, flood);
+    return true;
+}
+
+// echo: волна от инициатора строит остовное дерево, ответы возвращаются по нему к инициатору.
+// По каждой связи в каждую сторону проходит ровно одно сообщение.
+int workFunction_ECHO(Process *dp, Message &m) {
+    EventTimer timer;
+    int node = dp->node;
+    Neighbors neibs = dp->neibs();
+    if (!state.seen[node]) {
+        state.seen[node] = 1;
+        state.parent[node] = m.from;
+        Message token("ECHO_TOKEN");
+        for (auto n: neibs)
+            if (n != m.from) dp->networkLayer->send(node, n, token);
+    }
+    if (m.from >= 0) state.received[node]++;
+    if (state.received[node] == neibs.size() && state.parent[node] >= 0)
+        dp->networkLayer->send(node, state.parent[node], Message("ECHO_TOKEN"));
+    return true;
+}
+
+// bully: выборы начинают все процессы сразу. Процесс посылает ELECTION старшим соседям и ждёт ответа
+// по таймеру; старший отвечает ALIVE и начинает свои выборы; не дождавшийся ответа объявляет VICTORY соседям.
+int workFunction_BULLY(Process *dp, Message &m) {
+    static const int ELECTION = MessageTypes::id("BULLY_ELECTION"), ALIVE = MessageTypes::id("BULLY_ALIVE"),
+        VICTORY = MessageTypes::id("BULLY_VICTORY"), TIMEOUT = MessageTypes::id("BULLY_TIMEOUT");
+    EventTimer timer;
+    int node = dp->node;
+    NetworkLayer *nl = dp->networkLayer;
+    Neighbors neibs = dp->neibs();
+    if (m.type == ELECTION) {
+        if (m.from >= 0) nl->send(node, m.from, Message("BULLY_ALIVE"));
+        if (state.seen[node]) return true;
+        state.seen[node] = 1;
+        auto start = neibs.upper_bound(node);
+        Message election("BULLY_ELECTION");
+        for (auto i = start; i != neibs.end(); ++i) nl->send(node, *i, election);
+        state.timer[node] = dp->setTimer(4, "BULLY_TIMEOUT");
+    } else if (m.type == ALIVE) {
+        state.received[node]++;
+    } else if (m.type == VICTORY) {
+        if (m.from > state.coord[node]) state.coord[node] = m.from;
+        dp->cancelTimer(state.timer[node]);
+    } else if (m.type == TIMEOUT) {
+        if (state.received[node] == 0) {
+            state.coord[node] = node;
+            Message victory("BULLY_VICTORY");
+            for (auto n: neibs) nl->send(node, n, victory);
+        }
+    }
+    return true;
+}
+
+// Построить граф; возвращает число неориентированных связей или -1 для неизвестного графа.
+// Кроме star и all-to-all, графы строит генератор модели (TopologySpec), в том числе torus, erdos-renyi 
+// и scale-free; random-regular - степени 4.
+int64 buildGraph(World &w, string const &graph, int n, int latency) {
+    if (graph == "star") {
+        vector<pair<int, int> > edges;
+        for (int i = 1; i < n; i++) edges.push_back(make_pair(0, i));
+        w.nl.createLinks(edges, true, latency);
+        return n > 0 ? n - 1 : 0;
+    } else if (graph == "all-to-all") {
+        w.nl.addLinksAllToAll(latency);
+        return (int64)n * (n - 1) / 2;
+    }
+    TopologySpec spec;
+    spec.kind = graph;
+    spec.n = n;
+    spec.latency = latency;
+    spec.seed = 0x5EEDULL + n;
+    if (graph == "erdos-renyi") spec.param = 4;
+    return w.nl.generateTopology(spec);
+}
+
+int64 readProcStatus(const char *key) {
+    ifstream f("/proc/self/status");
+    string line;
+    size_t len = strlen(key);
+    while (getline(f, line))
+        if (line.compare(0, len, key) == 0) return atoll(line.c_str() + len);
+    return -1;
+}
+
+struct BenchResult {
+    string name;
+    int nodes = 0;
+    int64 edges = 0, events = 0;
+    double setup = 0, seconds = 0, rate = 0;
+    uint64 p50 = 0, p90 = 0, p99 = 0, p999 = 0, pmax = 0;
+    int64 rssKb = 0, threads = 0;
+};
+
+bool runScenario(string const &graph, string const &work, int n, int mode, int threads, BenchResult &r) {
+    static const char *modes[] = { "realtime", "virtual", "synchronous", "parallel" };
+    r.name = graph + "/" + work + "/" + to_string(n) + "/" + modes[mode];
+    r.nodes = n;
+    if (graph == "all-to-all" && n > 2000) return false;
+    if (work == "bully" && mode == NetworkLayer::RealTime) return false;
+    // Пиковая память процесса (VmHWM) сбрасывается перед каждым сценарием
+    { ofstream clear("/proc/self/clear_refs"); clear << "5"; }
+    {
+        lock_guard<mutex> ar(statsMutex);
+        allStats.clear();
+        statsEpoch++;
+    }
+    state.reset(n);
+    auto t0 = chrono::steady_clock::now();
+    World w;
+    w.nl.pool.setSize(threads);
+    w.nl.setMode(mode);
+    w.nl.quiet = true;
+    w.registerWorkFunction("FLOOD", workFunction_FLOOD);
+    w.registerWorkFunction("ECHO", workFunction_ECHO);
+    w.registerWorkFunction("BULLY", workFunction_BULLY);
+    for (int i = 0; i < n; i++) w.createProcess(i);
+    // В реальном времени такт - секунда, поэтому связи без задержки
+    r.edges = buildGraph(w, graph, n, mode == NetworkLayer::RealTime ? 0 : 1);
+    if (r.edges < 0) return false;
+    string func = work == "flood" ? "FLOOD" : work == "echo" ? "ECHO" : "BULLY";
+    for (int i = 0; i < n; i++) w.assignWorkFunction(i, func);
+    w.nl.topology();
+    auto t1 = chrono::steady_clock::now();
+    if (work == "bully") w.nl.send(-1, -1, Message("BULLY_ELECTION"));
+    else w.nl.send(-1, 0, Message(func == "FLOOD" ? "FLOOD" : "ECHO_TOKEN"));
+    w.runUntilQuiescent(w.nl.tick + 1000000);
+    auto t2 = chrono::steady_clock::now();
+    r.threads = readProcStatus("Threads:");
+    r.rssKb = readProcStatus("VmHWM:");
+    if (r.rssKb < 0) {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        r.rssKb = ru.ru_maxrss;
+    }
+    LatencyHistogram total;
+    {
+        lock_guard<mutex> ar(statsMutex);
+        for (auto const &ts: allStats) total.merge(ts->hist);
+    }
+    r.setup = chrono::duration<double>(t1 - t0).count();
+    r.seconds = chrono::duration<double>(t2 - t1).count();
+    r.events = (int64)total.events;
+    r.rate = r.seconds > 0 ? (double)r.events / r.seconds : 0;
+    r.p50 = total.percentile(0.5);
+    r.p90 = total.percentile(0.9);
+    r.p99 = total.percentile(0.99);
+    r.p999 = total.percentile(0.999);
+    r.pmax = total.percentile(1.0);
+    return true;
+}
+
+vector<string> splitList(string const &s) {
+    vector<string> ret;
+    stringstream ss(s);
+    string item;
+    while (getline(ss, item, ','))
+        if (!item.empty()) ret.push_back(item);
+    return ret;
+}
+
+const char *header = "# scenario                              nodes      edges     events  setup,s    run,s      msgs/s"
+    "   p50,ns   p90,ns   p99,ns  p999,ns   max,ns  rss,MB threads\n";
+
+void printResult(FILE *f, BenchResult const &r) {
+    fprintf(f, "%-36s %8d %10lld %10lld %8.3f %8.3f %11.0f %8llu %8llu %8llu %8llu %8llu %7.1f %7lld\n",
+        r.name.c_str(), r.nodes, r.edges, r.events, r.setup, r.seconds, r.rate,
+        r.p50, r.p90, r.p99, r.p999, r.pmax, r.rssKb / 1024.0, r.threads);
+}
+
+// Эталон: имя сценария -> сообщений в секунду
+map<string, double> readBaseline(string const &name) {
+    map<string, double> ret;
+    ifstream f(name.c_str());
+    string line;
+    while (getline(f, line)) {
+        if (line.empty() || line[0] == '#') continue;
+        stringstream ss(line);
+        string scenario;
+        double v[6];
+        ss >> scenario;
+        for (auto &x: v) ss >> x;
+        if (ss) ret[scenario] = v[5];
+    }
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    vector<string> graphs = splitList("ring,grid,random-regular,star,all-to-all");
+    vector<string> works = splitList("flood,echo,bully");
+    vector<int> sizes = { 100, 1000, 10000, 100000 };
+    int mode = NetworkLayer::Virtual, threads = 0;
+    string output, baseline;
+    double threshold = 10;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        string key = argv[i], value = argv[i + 1];
+        if (key == "-mode") {
+            if (value == "virtual") mode = NetworkLayer::Virtual;
+            else if (value == "parallel") mode = NetworkLayer::Parallel;
+            else if (value == "synchronous") mode = NetworkLayer::Synchronous;
+            else if (value == "realtime") mode = NetworkLayer::RealTime;
+            else { printf("unknown mode '%s'\n", value.c_str()); return 2; }
+        } else if (key == "-threads") threads = atoi(value.c_str());
+        else if (key == "-graphs") graphs = splitList(value);
+        else if (key == "-work") works = splitList(value);
+        else if (key == "-sizes") {
+            sizes.clear();
+            for (auto const &s: splitList(value)) sizes.push_back(atoi(s.c_str()));
+        }
+        else if (key == "-o") output = value;
+        else if (key == "-c") baseline = value;
+        else if (key == "-threshold") threshold = atof(value.c_str());
+        else { printf("unknown option '%s'\n", key.c_str()); return 2; }
+    }
+    if (threads <= 0) threads = (int)thread::hardware_concurrency();
+    map<string, double> base;
+    if (!baseline.empty()) base = readBaseline(baseline);
+    FILE *out = output.empty() ? nullptr : fopen(output.c_str(), "w");
+    printf("%s", header);
+    if (out != nullptr) fprintf(out, "%s", header);
+    int regressions = 0;
+    for (int n: sizes) {
+        for (auto const &graph: graphs) {
+            for (auto const &work: works) {
+                BenchResult r;
+                if (!runScenario(graph, work, n, mode, threads, r)) continue;
+                printResult(stdout, r);
+                if (out != nullptr) printResult(out, r);
+                auto it = base.find(r.name);
+                if (it != base.end() && it->second > 0) {
+                    double delta = 100.0 * (r.rate - it->second) / it->second;
+                    bool slow = delta < -threshold;
+                    if (slow) regressions++;
+                    printf("#   vs baseline %.0f msgs/s: %+.1f%%%s\n", it->second, delta, slow ? "  REGRESSION" : "");
+                }
+                fflush(stdout);
+            }
+        }
+    }
+    if (out != nullptr) fclose(out);
+    if (!base.empty()) printf("# %d regression(s) over %.0f%%\n", regressions, threshold);
+    return regressions > 0 ? 1 : 0;
+}
@@ -2,8 +2,6 @@
 struct context_common_s {
 };
 
-struct context_common_s context_common;
-
 // ATTN context
 struct context_attn_s {
   int  ready;
@@ -12,19 +10,15 @@ struct context_attn_s {
   }
 };
 
-struct context_attn_s context_attn;
-
 struct context_bully_s {
   int coord_id;
-  int start_time;
+  int64 timer_id;
   bool is_started;
   bool got_alive_message;
   context_bully_s() {
     coord_id = -1;
-    start_time = -1;
+    timer_id = -1;
     is_started = false;
     got_alive_message = false;
   }
 };
-
-struct context_bully_s context_bully;
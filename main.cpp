@@ -3,101 +3,142 @@
 #include <assert.h>
 #include <sstream>
 
-int workFunction_BULLY(Process *dp, Message m){
+int workFunction_BULLY(Process *dp, Message &m){
     int ELECTION_TIME = 10;
-    string s = m.getString();
+    // Номера типов сообщений получаем один раз; тип входящего сообщения уже известен по m.type
+    static const int ELECTION = MessageTypes::id("BULLY_ELECTION"), ALIVE = MessageTypes::id("BULLY_ALIVE"),
+        VICTORY = MessageTypes::id("BULLY_VICTORY"), TIMEOUT = MessageTypes::id("BULLY_TIMEOUT");
     NetworkLayer *nl = dp->networkLayer;
-    set<int> neibs = dp->neibs();
-    if (s == "BULLY_ELECTION"){
-        dp->context_bully.is_started = true;
-        printf("BULLY[%d]: ELECTION message received from %d\n", dp->node, m.from);
+    Neighbors neibs = dp->neibs();
+    context_bully_s &ctx = dp->ctx<context_bully_s>();
+    if (m.type == ELECTION){
+        ctx.is_started = true;
+        dp->log("BULLY[%d]: ELECTION message received from %d\n", dp->node, m.from);
         auto start = neibs.upper_bound(dp->node);
         if (start == neibs.end()) {
+            Message victory("BULLY_VICTORY");
             for(auto n: neibs){
-                nl->send(dp->node, n, Message("BULLY_VICTORY"));
-                dp->context_bully.is_started = false;
+                nl->send(dp->node, n, victory);
+                ctx.is_started = false;
             }
         } else {
+            Message election("BULLY_ELECTION");
             for (auto i = start; i != neibs.end(); ++i) {
-                nl->send(dp->node, *i, Message("BULLY_ELECTION"));
+                nl->send(dp->node, *i, election);
             }
+            // Ждём ответа от старших процессов ELECTION_TIME тактов
+            if (ctx.timer_id < 0)
+                ctx.timer_id = dp->setTimer(ELECTION_TIME, "BULLY_TIMEOUT");
             if (m.from == -1)
                 return true;
             nl->send(dp->node, m.from, Message("BULLY_ALIVE")); 
         }
-    } else if (s == "BULLY_ALIVE"){
-        dp->context_bully.got_alive_message = true;
-        printf("BULLY[%d]: ALIVE message received from %d\n", dp->node, m.from);
-    } else if (s == "BULLY_VICTORY"){
-        printf("BULLY[%d]: VICTORY message received from %d\n", dp->node, m.from);
+    } else if (m.type == ALIVE){
+        ctx.got_alive_message = true;
+        dp->log("BULLY[%d]: ALIVE message received from %d\n", dp->node, m.from);
+    } else if (m.type == VICTORY){
+        dp->log("BULLY[%d]: VICTORY message received from %d\n", dp->node, m.from);
         if (m.from < dp->node){
+            Message victory("BULLY_VICTORY");
             for (auto n:neibs) 
-                nl->send(dp->node, n, Message("BULLY_VICTORY"));
-            dp->context_bully.coord_id = dp->node;
+                nl->send(dp->node, n, victory);
+            ctx.coord_id = dp->node;
         } else {
-            dp->context_bully.coord_id = m.from; 
+            ctx.coord_id = m.from; 
         }
-        printf("BULLY[%d]: Coordinator is %d\n", dp->node, dp->context_bully.coord_id);
-        dp->context_bully.start_time = -1;
-        dp->context_bully.got_alive_message = false;
-        dp->context_bully.is_started = false;         
-    } else if (s == "*TIME") {
-        int val = m.getInt();
-        if (dp->context_bully.is_started) {
-            if (dp->context_bully.start_time != -1)
-                dp->context_bully.start_time = val;
-            if ((dp->context_bully.got_alive_message == false) && (val > dp->context_bully.start_time + ELECTION_TIME)){
+        dp->log("BULLY[%d]: Coordinator is %d\n", dp->node, ctx.coord_id);
+        dp->cancelTimer(ctx.timer_id);
+        ctx.timer_id = -1;
+        ctx.got_alive_message = false;
+        ctx.is_started = false;         
+    } else if (m.type == TIMEOUT) {
+        ctx.timer_id = -1;
+        if (ctx.is_started) {
+            if (ctx.got_alive_message == false){
+                Message victory("BULLY_VICTORY");
                 for (auto n: neibs)
-                    nl->send(dp->node, n, Message("BULLY_VICTORY"));
-                dp->context_bully.is_started = false;
-                dp->context_bully.start_time = -1;
-                dp->context_bully.coord_id = dp->node;
-                printf("BULLY[%d]: Wait too long! Coordinator is me.\n", dp->node);
-            } else if ((dp->context_bully.got_alive_message == true) && (val > dp->context_bully.start_time + ELECTION_TIME)) {
+                    nl->send(dp->node, n, victory);
+                ctx.is_started = false;
+                ctx.coord_id = dp->node;
+                dp->log("BULLY[%d]: Wait too long! Coordinator is me.\n", dp->node);
+            } else {
                 auto start = neibs.upper_bound(dp->node);
+                Message election("BULLY_ELECTION");
                 for (auto i = start; i != neibs.end(); ++i) {
-                    nl->send(dp->node, *i, Message("BULLY_ELECTION"));
+                    nl->send(dp->node, *i, election);
                 }
-                printf("BULLY[%d]: Wait too long! Start new elections.\n", dp->node);
-                dp->context_bully.start_time = -1;
+                dp->log("BULLY[%d]: Wait too long! Start new elections.\n", dp->node);
+                ctx.got_alive_message = false;
+                ctx.timer_id = dp->setTimer(ELECTION_TIME, "BULLY_TIMEOUT");
             }
         }
     }
     return true;    
 }
 
-int workFunction_TEST(Process *dp, Message m)
+int workFunction_TEST(Process *dp, Message &m)
 {
     string s = m.getString();
     NetworkLayer *nl = dp->networkLayer;
     if (!dp->isMyMessage("TEST", s)) return false;
-    set<int> neibs = dp->neibs(); 
+    Neighbors neibs = dp->neibs(); 
     if (s == "TEST_HELLO") {
-        int val = m.getInt();
-        printf("TEST[%d]: HELLO %d message received from %d\n", dp->node, val, m.from);
+        int val = m.read<int>();
+        dp->log("TEST[%d]: HELLO %d message received from %d\n", dp->node, val, m.from);
         // Рассылаем сообщение соседям
+        // Тело сообщения создаётся один раз и разделяется всеми соседями
         if (val < 2) {
+            Message hello = Message::make("TEST_HELLO", val + 1);
             for (auto n: neibs) {
-                nl->send(dp->node, n, Message("TEST_HELLO", val+1));
+                nl->send(dp->node, n, hello);
             }
         } else {
+            Message bye("TEST_BYE");
             for (auto n: neibs) {
-                nl->send(dp->node, n, Message("TEST_BYE"));
+                nl->send(dp->node, n, bye);
             }
         }
     } else if (s == "TEST_BYE") {
-        printf("TEST[%d]: BYE message received from %d\n", dp->node, m.from);
+        dp->log("TEST[%d]: BYE message received from %d\n", dp->node, m.from);
     }
     return true;
 }
 
+// Итог выборов: координатор, если все знающие его процессы согласны, иначе -1
+int64 outcome_BULLY(World &w)
+{
+    int64 coord = -1;
+    bool agreed = true;
+    w.forEachContext<context_bully_s>([&](int, context_bully_s const &c) {
+        if (c.coord_id < 0) return;
+        if (coord >= 0 && coord != c.coord_id) agreed = false;
+        coord = c.coord_id;
+    });
+    return agreed ? coord : -1;
+}
+
+// model [файл конфигурации] [число реплик [seed]]
+// model файл конфигурации -replay трасса
 int main(int argc, char **argv)
 {
     string configFile = argc > 1 ? argv[1] : "config.data";
+    bool replay = argc > 3 && strcmp(argv[2], "-replay") == 0;
+    if (argc > 2 && !replay) {
+        ReplicaRunner runner;
+        runner.registerWorkFunction<context_bully_s>("BULLY", workFunction_BULLY);
+        runner.outcome = outcome_BULLY;
+        uint64 seed = argc > 3 ? strtoull(argv[3], nullptr, 0) : NetworkLayer::DefaultSeed;
+        ReplicaRunner::report(runner.run(configFile, atoi(argv[2]), seed));
+        return 0;
+    }
     World w; 
-    w.registerWorkFunction("BULLY", workFunction_BULLY);
+    w.registerWorkFunction<context_bully_s>("BULLY", workFunction_BULLY);
+    if (replay && !w.replay(argv[3])) {
+        printf("can't read trace '%s'\n", argv[3]);
+        return 1;
+    }
     if (w.parseConfig(configFile)) {
-        this_thread::sleep_for(chrono::milliseconds(3000000));
+        w.runUntilQuiescent(w.nl.tick + 3000);
 	} else {
         printf("can't open file '%s'\n", configFile.c_str());
     }
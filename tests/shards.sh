@@ -0,0 +1,35 @@
+#!/bin/sh
+# Шарды и длинный файл конфигурации: директивы после первого wait (он порождает шарды) должны 
+# разобрать все шарды целиком. Файл больше буфера ввода-вывода, вывод сравнивается с прогоном без шардов.
+# Запуск: make test
+model=${1:-./model}
+dir=$(mktemp -d) || exit 1
+trap 'rm -rf "$dir"' EXIT
+config() {
+    [ "$1" -gt 1 ] && echo "shards $1"
+    echo "mode virtual"
+    grep -v '^;' config.data
+    echo "wait 5"
+    i=0
+    while [ $i -lt 3000 ]; do
+        echo "; padding $i ............................................................"
+        i=$((i + 1))
+    done
+    echo "send from -1 to 2 BULLY_ELECTION"
+    echo "wait 50"
+    echo "send from -1 to 3 BULLY_ELECTION"
+}
+config 1 > "$dir/one.data"
+"$model" "$dir/one.data" | sort > "$dir/one.out"
+status=0
+for n in 2 3; do
+    config $n > "$dir/sharded.data"
+    "$model" "$dir/sharded.data" | sort > "$dir/sharded.out"
+    if cmp -s "$dir/one.out" "$dir/sharded.out"; then
+        echo "shards $n: ok"
+    else
+        echo "shards $n: FAILED ($(wc -l < "$dir/sharded.out") lines, expected $(wc -l < "$dir/one.out"))"
+        status=1
+    fi
+done
+exit $status